@@ -45,6 +45,13 @@ inline aabb surrounding_box(aabb box0, aabb box1) {
   return aabb(small, big);
 }
 
+// Linear blend of the boxes at shutter open (s = 0) and close (s = 1).
+// For linearly moving geometry this is the exact box at the blended time.
+inline aabb lerp(const aabb &box0, const aabb &box1, double s) {
+  return aabb(box0.min() + s * (box1.min() - box0.min()),
+              box0.max() + s * (box1.max() - box0.max()));
+}
+
 } // namespace raytracer
 
 #endif // AABB_H_
@@ -0,0 +1,330 @@
+#ifndef ANIMATION_H_
+#define ANIMATION_H_
+
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "motion_bvh.hpp"
+#include "render.hpp"
+#include "renderer.hpp"
+#include "replicate.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace raytracer {
+
+inline Vector blend(const Vector &a, const Vector &b, double s) {
+  return a + s * (b - a);
+}
+
+inline camera_params blend(const camera_params &a, const camera_params &b,
+                           double s) {
+  auto c = a;
+  c.lookfrom = blend(a.lookfrom, b.lookfrom, s);
+  c.lookat = blend(a.lookat, b.lookat, s);
+  c.vup = blend(a.vup, b.vup, s);
+  c.vfov = a.vfov + s * (b.vfov - a.vfov);
+  c.aperture = a.aperture + s * (b.aperture - a.aperture);
+  c.focus_dist = a.focus_dist + s * (b.focus_dist - a.focus_dist);
+  return c;
+}
+
+// Values at points in time, blended linearly in between and held before
+// the first and after the last key.
+template <typename T> class keyframes {
+public:
+  keyframes &add(double time, const T &value) {
+    auto it = std::upper_bound(
+        keys.begin(), keys.end(), time,
+        [](double t, const std::pair<double, T> &key) { return t < key.first; });
+    keys.insert(it, {time, value});
+    return *this;
+  }
+
+  bool empty() const { return keys.empty(); }
+
+  T at(double time) const {
+    if (keys.size() == 1 || time <= keys.front().first)
+      return keys.front().second;
+    if (time >= keys.back().first)
+      return keys.back().second;
+    auto next = std::upper_bound(
+        keys.begin(), keys.end(), time,
+        [](double t, const std::pair<double, T> &key) { return t < key.first; });
+    auto prev = next - 1;
+    return blend(prev->second, next->second,
+                 (time - prev->first) / (next->first - prev->first));
+  }
+
+  // Calls fn(value) for the keys strictly between time0 and time1, where the
+  // motion bends.
+  template <typename Fn> void between(double time0, double time1, Fn fn) const {
+    for (const auto &key : keys)
+      if (key.first > time0 && key.first < time1)
+        fn(key.second);
+  }
+
+  // Whether the value changes at all, for vector tracks.
+  bool varies() const {
+    for (const auto &key : keys)
+      if (!(key.second - keys.front().second).near_zero())
+        return true;
+    return false;
+  }
+
+private:
+  std::vector<std::pair<double, T>> keys;
+};
+
+// An object moved along a keyframed path: at time t it is where object is
+// at t, offset by path.at(t). The object is not sampled as a light.
+class keyframed : public hittable {
+public:
+  keyframed(shared_ptr<hittable> _object, keyframes<Vector> _path)
+      : object(std::move(_object)), path(std::move(_path)) {}
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   hit_record &rec) const override {
+    auto offset = path.at(r.time());
+    Ray moved(r.origin() - offset, r.direction(), r.time());
+    if (!object->hit(moved, t_min, t_max, rec))
+      return false;
+    rec.p += offset;
+    rec.object = this;
+    return true;
+  }
+
+  virtual bool bounding_box(double time0, double time1,
+                            aabb &output_box) const override {
+    aabb box;
+    if (!object->bounding_box(time0, time1, box))
+      return false;
+    auto moved = [&](const Vector &offset) {
+      return aabb(box.min() + offset, box.max() + offset);
+    };
+    output_box = surrounding_box(moved(path.at(time0)), moved(path.at(time1)));
+    path.between(time0, time1, [&](const Vector &offset) {
+      output_box = surrounding_box(output_box, moved(offset));
+    });
+    return true;
+  }
+
+  virtual Vector displacement(double time0, double time1) const override {
+    return path.at(time1) - path.at(time0) +
+           object->displacement(time0, time1);
+  }
+
+  virtual bool animated() const override {
+    return path.varies() || object->animated();
+  }
+
+  virtual shared_ptr<hittable> replicate(replica_map &map) const override {
+    return make_shared<keyframed>(map.get(object), path);
+  }
+
+private:
+  shared_ptr<hittable> object;
+  keyframes<Vector> path;
+};
+
+// Acceleration structure of an animated scene. Objects that never move go
+// into a BVH built once; the others into a second BVH that every frame
+// refits to its shutter interval instead of rebuilding.
+class animated_world {
+public:
+  animated_world(const Scene &scene, double time0, double time1) {
+    hittable_list fixed, moving;
+    for (const auto &object : scene.objects.objects)
+      (object->animated() ? moving : fixed).add(object);
+    if (!fixed.objects.empty())
+      static_bvh = make_shared<motion_bvh>(fixed, time0, time1);
+    if (!moving.objects.empty())
+      moving_bvh = make_shared<motion_bvh>(moving, time0, time1);
+    moving_count = moving.objects.size();
+  }
+
+  // World for the interval [time0, time1]. The refit happens in place, so
+  // the previous frame must be done. Every frame gets a new top level
+  // object, so that renderers caching per world notice the change.
+  shared_ptr<hittable> frame(double time0, double time1) {
+    auto world = make_shared<hittable_list>();
+    if (static_bvh)
+      world->add(static_bvh);
+    if (moving_bvh) {
+      moving_bvh->refit(time0, time1);
+      world->add(moving_bvh);
+    }
+    return world;
+  }
+
+  size_t moving_objects() const { return moving_count; }
+
+private:
+  shared_ptr<motion_bvh> static_bvh, moving_bvh;
+  size_t moving_count = 0;
+};
+
+struct animation_settings {
+  int frames = 48;
+  // Scene time the animation covers; frame k starts at
+  // time0 + (time1 - time0) * k / frames.
+  double time0 = 0;
+  double time1 = 1;
+  // Fraction of a frame the shutter stays open, for motion blur.
+  double shutter = 0.5;
+  bool progress = true;
+};
+
+struct animation_stats {
+  int frames = 0;
+  double seconds = 0;      // wall time of the whole animation
+  double render = 0;       // of which rendering
+  double refit = 0;        // of which BVH refits
+  double write_stall = 0;  // waiting for the previous frame to be written
+
+  double frames_per_hour() const {
+    return seconds > 0 ? frames * 3600 / seconds : 0;
+  }
+};
+
+// Hands frames to write(frame, fb) on a background thread, so that the next
+// frame renders while the last one is resolved, encoded and written. At
+// most one frame waits; submit() blocks until the slot is free, so no frame
+// is dropped.
+template <typename Writer> class frame_writer {
+public:
+  explicit frame_writer(Writer _write)
+      : write(std::move(_write)), worker([this] { run(); }) {}
+
+  ~frame_writer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+  }
+
+  frame_writer(const frame_writer &) = delete;
+  frame_writer &operator=(const frame_writer &) = delete;
+
+  void submit(int frame, framebuffer &&fb) {
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [this] { return !pending; });
+    pending.emplace(frame, std::move(fb));
+    wake.notify_all();
+  }
+
+  // Waits until the last submitted frame is written.
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [this] { return !pending; });
+  }
+
+  // Whether every write so far succeeded.
+  bool ok() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return succeeded;
+  }
+
+private:
+  Writer write;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::optional<std::pair<int, framebuffer>> pending;
+  bool stopping = false;
+  bool succeeded = true;
+  std::thread worker; // last, so it starts after the members it uses
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [this] { return stopping || pending; });
+      if (pending) {
+        auto frame = std::move(*pending);
+        lock.unlock();
+        bool done = write(frame.first, frame.second);
+        lock.lock();
+        succeeded = succeeded && done;
+        pending.reset();
+        wake.notify_all();
+      } else if (stopping) {
+        return;
+      }
+    }
+  }
+};
+
+// Renders the frames of an animation of scene seen through camera on
+// renderer, and passes each to write(frame, fb), which returns whether it
+// succeeded. Writing runs on its own thread, overlapped with rendering the
+// next frame. The scene's world is replaced by an animated_world. Stops at
+// the first failed write and returns false. Not supported by renderers that
+// replicate the scene per NUMA node: each frame's new world would be copied
+// and rebuilt on every node instead of refitted.
+template <typename Writer>
+inline bool render_animation(Renderer &renderer, Scene &scene,
+                             const keyframes<camera_params> &camera,
+                             const Sampler &sampler, render_settings settings,
+                             const animation_settings &anim, Writer write,
+                             animation_stats &stats) {
+  using clock = std::chrono::steady_clock;
+  const auto start = clock::now();
+  const double frame_time = (anim.time1 - anim.time0) / anim.frames;
+  settings.progress = false;
+  stats = animation_stats();
+  if (renderer.replicates()) {
+    std::cerr << "ERROR: Animations cannot be rendered with per node scene "
+                 "replicas.\n";
+    return false;
+  }
+
+  animated_world world(scene, anim.time0, anim.time1);
+  frame_writer<Writer> writer(std::move(write));
+  for (int k = 0; k < anim.frames && writer.ok(); ++k) {
+    const double t0 = anim.time0 + frame_time * k;
+    const double t1 = t0 + frame_time * anim.shutter;
+
+    auto t = clock::now();
+    scene.set_world(world.frame(t0, t1), t0, t1);
+    stats.refit += std::chrono::duration<double>(clock::now() - t).count();
+
+    auto view = camera.at(t0);
+    view.time0 = t0;
+    view.time1 = t1;
+    t = clock::now();
+    auto fb = renderer.render(scene, view.camera(), sampler, settings);
+    stats.render += std::chrono::duration<double>(clock::now() - t).count();
+
+    t = clock::now();
+    writer.submit(k, std::move(fb));
+    stats.write_stall +=
+        std::chrono::duration<double>(clock::now() - t).count();
+    ++stats.frames;
+
+    if (anim.progress) {
+      stats.seconds =
+          std::chrono::duration<double>(clock::now() - start).count();
+      std::fprintf(stderr, "\rFrame %d/%d, %.0f frames/hour", k + 1,
+                   anim.frames, stats.frames_per_hour());
+    }
+  }
+  writer.flush();
+  stats.seconds = std::chrono::duration<double>(clock::now() - start).count();
+  return writer.ok();
+}
+
+} // namespace raytracer
+
+#endif // ANIMATION_H_
@@ -0,0 +1,141 @@
+#ifndef AOV_H_
+#define AOV_H_
+
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "rtweekend.hpp"
+#include "scene.hpp"
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace raytracer {
+
+// Arbitrary output variables: per pixel data about the first hit, recorded
+// next to the colour for denoising, compositing and debugging.
+enum aov_flag : unsigned {
+  aov_albedo = 1 << 0,
+  aov_normal = 1 << 1,
+  aov_depth = 1 << 2,
+  aov_object_id = 1 << 3,
+  aov_motion = 1 << 4,
+};
+
+inline const char *aov_name(aov_flag flag) {
+  switch (flag) {
+  case aov_albedo:
+    return "albedo";
+  case aov_normal:
+    return "normal";
+  case aov_depth:
+    return "depth";
+  case aov_object_id:
+    return "id";
+  case aov_motion:
+    return "motion";
+  }
+  return "";
+}
+
+constexpr aov_flag all_aovs[] = {aov_albedo, aov_normal, aov_depth,
+                                 aov_object_id, aov_motion};
+
+// Parses a comma separated list of AOV names. Returns false on an unknown
+// name.
+inline bool parse_aovs(const std::string &list, unsigned &flags) {
+  std::stringstream ss(list);
+  std::string name;
+  while (std::getline(ss, name, ',')) {
+    bool found = false;
+    for (auto flag : all_aovs)
+      if (name == aov_name(flag)) {
+        flags |= flag;
+        found = true;
+      }
+    if (!found)
+      return false;
+  }
+  return true;
+}
+
+// What the camera ray of a sample hit, filled in by ray_color. Rays that
+// leave the scene have hit = false and the background as albedo.
+struct first_hit {
+  bool hit = false;
+  Point p;
+  Vector n;
+  Color albedo;
+  double distance = 0;
+  double time = 0;
+  const hittable *object = nullptr;
+};
+
+// Per pixel AOV sums, indexed like framebuffer. Only the enabled buffers
+// are allocated; with none enabled the render takes its usual path.
+struct aov_buffers {
+  unsigned enabled = 0;
+  int width = 0;
+  int height = 0;
+  std::vector<Color> albedo;
+  std::vector<Vector> normal;
+  std::vector<double> depth;     // distance along the camera ray, 0 on a miss
+  std::vector<int32_t> object_id; // of the first sample, -1 on a miss
+  std::vector<Vector> motion;    // in pixels over the shutter interval, z = 0
+  std::vector<uint32_t> count;
+
+  aov_buffers() {}
+  aov_buffers(int w, int h, unsigned flags)
+      : enabled(flags), width(w), height(h) {
+    if (!enabled)
+      return;
+    const int n = w * h;
+    if (enabled & aov_albedo)
+      albedo.resize(n);
+    if (enabled & aov_normal)
+      normal.resize(n);
+    if (enabled & aov_depth)
+      depth.resize(n);
+    if (enabled & aov_object_id)
+      object_id.assign(n, -1);
+    if (enabled & aov_motion)
+      motion.resize(n);
+    count.resize(n);
+  }
+
+  void add(int p, const first_hit &h, const Scene &scene, const Camera &cam) {
+    if (enabled & aov_albedo)
+      albedo[p] += h.albedo;
+    if (enabled & aov_normal)
+      normal[p] += h.n;
+    if (enabled & aov_depth)
+      depth[p] += h.distance;
+    if ((enabled & aov_object_id) && count[p] == 0)
+      object_id[p] = h.hit ? scene.object_id(h.object) : -1;
+    if ((enabled & aov_motion) && h.hit && h.object)
+      motion[p] += motion_vector(h, cam);
+    ++count[p];
+  }
+
+  // Screen space motion of the hit point from shutter open to close. The
+  // camera is static, so only moving objects contribute.
+  Vector motion_vector(const first_hit &h, const Camera &cam) const {
+    auto t0 = cam.shutter_open(), t1 = cam.shutter_close();
+    auto d = h.object->displacement(t0, t1);
+    if (d.near_zero() || t1 <= t0)
+      return Vector(0, 0, 0);
+    auto p0 = h.p - (h.time - t0) / (t1 - t0) * d;
+    auto [s0, v0] = cam.project(p0);
+    auto [s1, v1] = cam.project(p0 + d);
+    return Vector((s1 - s0) * (width - 1), (v1 - v0) * (height - 1), 0);
+  }
+
+  template <typename T> T mean(const std::vector<T> &sums, int p) const {
+    return count[p] ? sums[p] / static_cast<double>(count[p]) : T();
+  }
+};
+
+} // namespace raytracer
+
+#endif // AOV_H_
@@ -3,6 +3,8 @@
 
 #include "rtweekend.hpp"
 
+#include <utility>
+
 namespace raytracer {
 
 class Camera {
@@ -31,15 +33,38 @@ public:
   }
 
   Ray get_ray(double s, double t) const {
-    Vector rd = lens_radius * random_in_unit_disk<double>();
+    return get_ray(s, t, random_draw<double>(), random_draw<double>(),
+                   random_draw<double>());
+  }
+
+  // Ray through viewport coordinates (s, t) with explicit lens and shutter
+  // samples in [0,1), so that a sampler can stratify them.
+  Ray get_ray(double s, double t, double lens_u, double lens_v,
+              double time_u) const {
+    Vector rd = lens_radius * sample_concentric_disk(lens_u, lens_v);
     Vector offset = u * rd.x() + v * rd.y();
-    // Vector offset = u * rd.x() + v * rd.y();
     return Ray(origin + offset,
                lower_left_corner + s * horizontal + t * vertical - origin -
                    offset,
-               random_draw<double>(time0, time1));
+               time0 + time_u * (time1 - time0));
+  }
+
+  // Viewport coordinates (s, t) at which the pinhole ray through p crosses
+  // the focus plane; the inverse of get_ray without lens offset.
+  std::pair<double, double> project(const Point &p) const {
+    auto d = p - origin;
+    auto denom = dot(d, w);
+    if (denom == 0)
+      return {0, 0};
+    auto q = origin + dot(lower_left_corner - origin, w) / denom * d -
+             lower_left_corner;
+    return {dot(q, horizontal) / horizontal.length_squared(),
+            dot(q, vertical) / vertical.length_squared()};
   }
 
+  double shutter_open() const { return time0; }
+  double shutter_close() const { return time1; }
+
 private:
   Point origin;
   Point lower_left_corner;
@@ -50,5 +75,23 @@ private:
   double time0, time1;
 };
 
+// Arguments of the Camera constructor.
+struct camera_params {
+  Point lookfrom{13, 2, 3};
+  Point lookat{0, 0, 0};
+  Vector vup{0, 1, 0};
+  double vfov = 20;
+  double aspect_ratio = 16.0 / 9.0;
+  double aperture = 0.1;
+  double focus_dist = 10;
+  double time0 = 0;
+  double time1 = 1;
+
+  Camera camera() const {
+    return Camera(lookfrom, lookat, vup, vfov, aspect_ratio, aperture,
+                  focus_dist, time0, time1);
+  }
+};
+
 } // namespace raytracer
 #endif
@@ -0,0 +1,235 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include "aabb.hpp"
+#include "render.hpp"
+#include "rtweekend.hpp"
+#include "scene.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+namespace raytracer {
+
+// FNV-1a over the bytes of the values added, used to tell whether a
+// checkpoint belongs to the render being resumed.
+class fingerprint {
+public:
+  fingerprint &add(const void *data, size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+      h ^= bytes[i];
+      h *= 0x100000001b3ULL;
+    }
+    return *this;
+  }
+
+  template <typename T> fingerprint &add(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    return add(&value, sizeof(T));
+  }
+
+  fingerprint &add(const std::string &s) {
+    add(s.size());
+    return add(s.data(), s.size());
+  }
+
+  uint64_t value() const { return h; }
+
+private:
+  uint64_t h = 0xcbf29ce484222325ULL;
+};
+
+// Scenes are built in code and cannot be serialised, so they are identified
+// by their object bounds and background instead.
+inline void add_scene(fingerprint &f, const Scene &scene, double time0,
+                      double time1) {
+  f.add(scene.objects.objects.size()).add(scene.lights.objects.size());
+  for (const auto &object : scene.objects.objects) {
+    aabb box0, box1;
+    if (object->bounding_box(time0, time0, box0) &&
+        object->bounding_box(time1, time1, box1))
+      f.add(box0.min()).add(box0.max()).add(box1.min()).add(box1.max());
+  }
+  f.add(scene.background.sky).add(scene.background.color);
+}
+
+// Binary checkpoint of a framebuffer: a header followed by the raw sums and
+// counts, then the enabled AOV buffers. Sample sequences are a function of
+// the pixel, the sample index and the seed, so the counts are all the
+// sampler state a resume needs.
+struct checkpoint_header {
+  char magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '2'};
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint64_t key = 0;  // fingerprint of scene, camera, settings and seed
+  uint32_t aovs = 0; // aov_flag bits of the buffers that follow
+  uint32_t reserved = 0;
+};
+
+namespace detail {
+
+// Calls fn(data, bytes) for each AOV buffer, in file order. Buffers of
+// disabled AOVs are empty.
+template <typename Buffers, typename Fn>
+inline void for_each_aov_buffer(Buffers &aov, Fn fn) {
+  auto each = [&](auto &buffer) {
+    fn(buffer.data(), buffer.size() * sizeof(buffer[0]));
+  };
+  each(aov.albedo);
+  each(aov.normal);
+  each(aov.depth);
+  each(aov.object_id);
+  each(aov.motion);
+  each(aov.count);
+}
+
+} // namespace detail
+
+inline bool save_checkpoint(const std::string &path, const framebuffer &fb,
+                            uint64_t key) {
+  checkpoint_header header;
+  header.width = fb.width;
+  header.height = fb.height;
+  header.key = key;
+  header.aovs = fb.aov.enabled;
+
+  auto tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out) {
+      std::cerr << "ERROR: Could not open '" << tmp << "' for writing.\n";
+      return false;
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(fb.sum.data()),
+              fb.sum.size() * sizeof(Color));
+    out.write(reinterpret_cast<const char *>(fb.sum_lum2.data()),
+              fb.sum_lum2.size() * sizeof(double));
+    out.write(reinterpret_cast<const char *>(fb.count.data()),
+              fb.count.size() * sizeof(uint32_t));
+    detail::for_each_aov_buffer(fb.aov, [&](const void *data, size_t size) {
+      out.write(static_cast<const char *>(data), size);
+    });
+    if (!out.flush()) {
+      std::cerr << "ERROR: Could not write '" << tmp << "'.\n";
+      return false;
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::cerr << "ERROR: Could not rename '" << tmp << "' to '" << path
+              << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+// Loads a checkpoint into fb, which must have the right size and AOVs. Fails
+// if the checkpoint was written for a different render.
+inline bool load_checkpoint(const std::string &path, framebuffer &fb,
+                            uint64_t key) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::cerr << "ERROR: Could not open checkpoint '" << path << "'.\n";
+    return false;
+  }
+  checkpoint_header header, expected;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || std::memcmp(header.magic, expected.magic, sizeof(header.magic))) {
+    std::cerr << "ERROR: '" << path << "' is not a checkpoint.\n";
+    return false;
+  }
+  if (header.width != static_cast<uint32_t>(fb.width) ||
+      header.height != static_cast<uint32_t>(fb.height) || header.key != key) {
+    std::cerr << "ERROR: Checkpoint '" << path
+              << "' belongs to a different scene, camera or setting.\n";
+    return false;
+  }
+  if (header.aovs != fb.aov.enabled) {
+    std::cerr << "ERROR: Checkpoint '" << path
+              << "' was saved with other AOVs; --aov and --denoise must "
+                 "match the checkpointed render.\n";
+    return false;
+  }
+  in.read(reinterpret_cast<char *>(fb.sum.data()),
+          fb.sum.size() * sizeof(Color));
+  in.read(reinterpret_cast<char *>(fb.sum_lum2.data()),
+          fb.sum_lum2.size() * sizeof(double));
+  in.read(reinterpret_cast<char *>(fb.count.data()),
+          fb.count.size() * sizeof(uint32_t));
+  detail::for_each_aov_buffer(fb.aov, [&](void *data, size_t size) {
+    in.read(static_cast<char *>(data), size);
+  });
+  if (!in) {
+    std::cerr << "ERROR: Checkpoint '" << path << "' is truncated.\n";
+    return false;
+  }
+  return true;
+}
+
+// Writes checkpoints on a background thread. submit() only copies the
+// framebuffer; if the previous checkpoint is still being written, the newer
+// snapshot replaces any that is waiting.
+class checkpoint_writer {
+public:
+  checkpoint_writer(std::string _path, uint64_t _key)
+      : path(std::move(_path)), key(_key), worker([this] { run(); }) {}
+
+  ~checkpoint_writer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+
+  checkpoint_writer(const checkpoint_writer &) = delete;
+  checkpoint_writer &operator=(const checkpoint_writer &) = delete;
+
+  void submit(const framebuffer &fb) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending = fb;
+    }
+    wake.notify_one();
+  }
+
+private:
+  std::string path;
+  uint64_t key;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::optional<framebuffer> pending;
+  bool stopping = false;
+  std::thread worker; // last, so it starts after the members it uses
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [this] { return stopping || pending; });
+      if (pending) {
+        auto fb = std::move(*pending);
+        pending.reset();
+        lock.unlock();
+        save_checkpoint(path, fb, key);
+        lock.lock();
+      } else if (stopping) {
+        return;
+      }
+    }
+  }
+};
+
+} // namespace raytracer
+
+#endif // CHECKPOINT_H_
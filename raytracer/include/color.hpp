@@ -1,9 +1,12 @@
 #ifndef _COLOR
 #define _COLOR
 
+#include "aov.hpp"
 #include "hittable.hpp"
 #include "material.hpp"
 #include "rtweekend.hpp"
+#include "scene.hpp"
+#include "telemetry.hpp"
 #include <cmath>
 #include <iostream>
 #include <vector>
@@ -50,23 +53,115 @@ inline Color mult_col(const Color &c1, const Color &c2) {
   return Color(c1.x() * c2.x(), c1.y() * c2.y(), c1.z() * c2.z());
 }
 
-inline Color ray_color(const Ray &r, const hittable &world, int depth) {
-  hit_record rec;
+// Path vertex after which Russian roulette may end a path.
+constexpr int roulette_start = 3;
+// Upper bound on the survival probability, so that paths through lossless
+// materials such as glass also end.
+constexpr double roulette_max_survival = 0.95;
 
-  if (depth <= 0)
-    return Color(0, 0, 0);
+// Power heuristic weight of a strategy with density pdf_a against pdf_b.
+inline double power_heuristic(double pdf_a, double pdf_b) {
+  auto a2 = pdf_a * pdf_a, b2 = pdf_b * pdf_b;
+  return a2 + b2 > 0 ? a2 / (a2 + b2) : 0;
+}
+
+// Iterative path tracer. The product of the attenuations along the path is
+// carried as throughput; after roulette_start vertices a path survives with
+// probability equal to its largest throughput component and is reweighted
+// by the inverse, which keeps the estimate unbiased. depth only caps the
+// number of vertices.
+//
+// At diffuse vertices the scene's lights are also sampled directly (next
+// event estimation). Light found that way and light found by the BSDF
+// sampled continuation are combined with multiple importance sampling.
+//
+// If primary is given, it receives what the camera ray hit. Rays traced and
+// vertices scattered are added to thread_ray_counts().
+inline Color ray_color(const Ray &r, const Scene &scene, int depth,
+                       first_hit *primary = nullptr) {
+  const hittable &world = *scene.world;
+  auto &counts = thread_ray_counts();
+  const bool sample_lights = !scene.lights.objects.empty();
+  Color radiance(0, 0, 0);
+  Color throughput(1, 1, 1);
+  Ray ray = r;
+  // BSDF density of the direction that led to the current vertex, or 0 if
+  // the previous vertex did not sample lights.
+  double bsdf_pdf = 0;
+
+  for (int bounce = 0; bounce < depth; ++bounce) {
+    hit_record rec;
+    ++counts.rays;
+    if (!world.hit(ray, 0.001, infinity, rec)) {
+      auto background = scene.background.value(ray);
+      if (primary && bounce == 0)
+        primary->albedo = background;
+      radiance += mult_col(throughput, background);
+      break;
+    }
+    if (primary && bounce == 0) {
+      primary->hit = true;
+      primary->p = rec.p;
+      primary->n = rec.n;
+      primary->albedo = rec.mat_ptr->base_color(rec);
+      primary->distance = rec.t * ray.direction().length();
+      primary->time = ray.time();
+      primary->object = rec.object;
+    }
+
+    Color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (!emitted.near_zero()) {
+      auto weight = 1.0;
+      if (bsdf_pdf > 0)
+        weight = power_heuristic(
+            bsdf_pdf, scene.lights.pdf_value(ray.origin(), ray.direction()));
+      radiance += mult_col(throughput, emitted) * weight;
+    }
 
-  if (world.hit(r, 0.001, infinity, rec)) {
     Ray scattered;
     Color attenuation;
-    if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-      return mult_col(attenuation, ray_color(scattered, world, depth - 1));
-    return Color(0, 0, 0);
+    if (!rec.mat_ptr->scatter(ray, rec, attenuation, scattered))
+      break;
+    ++counts.bounces;
+
+    bsdf_pdf = 0;
+    if (sample_lights && rec.mat_ptr->is_diffuse()) {
+      auto to_light =
+          scene.lights.random(rec.p, sample_bounce_value(bounce_dim_light_u),
+                              sample_bounce_value(bounce_dim_light_v));
+      auto light_pdf = scene.lights.pdf_value(rec.p, to_light);
+      auto f = rec.mat_ptr->eval(ray, rec, to_light);
+      hit_record light_rec;
+      const bool shadow_ray = light_pdf > 0 && !f.near_zero();
+      counts.rays += shadow_ray;
+      if (shadow_ray && world.hit(Ray(rec.p, to_light, ray.time()), 0.001,
+                                  infinity, light_rec)) {
+        auto weight = power_heuristic(
+            light_pdf, rec.mat_ptr->scattering_pdf(ray, rec, to_light));
+        auto light =
+            light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+        radiance +=
+            mult_col(throughput, mult_col(f, light)) * (weight / light_pdf);
+      }
+      bsdf_pdf =
+          rec.mat_ptr->scattering_pdf(ray, rec, scattered.direction());
+    }
+    throughput = mult_col(throughput, attenuation);
+
+    if (bounce + 1 >= roulette_start) {
+      auto survival = fmin(
+          fmax(throughput.x(), fmax(throughput.y(), throughput.z())),
+          roulette_max_survival);
+      if (sample_bounce_value(bounce_dim_roulette) >= survival)
+        break;
+      throughput /= survival;
+    }
+
+    sample_next_bounce();
+    ray = scattered;
   }
 
-  Vector unit_direction = unit_vector(r.direction());
-  auto t = 0.5 * (unit_direction.y() + 1.0);
-  return (1.0 - t) * Color(1.0, 1.0, 1.0) + t * Color(0.5, 0.7, 1.0);
+  return radiance;
 }
 
 } // namespace raytracer
@@ -0,0 +1,267 @@
+#ifndef DENOISE_H_
+#define DENOISE_H_
+
+#include "aov.hpp"
+#include "camera.hpp"
+#include "render.hpp"
+#include "rtweekend.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace raytracer {
+
+// Surface properties at the first hit, averaged over the pixel, indexed like
+// framebuffer. Pixels whose rays leave the scene get the background as
+// albedo, a zero normal and depth 0.
+struct feature_buffers {
+  int width = 0;
+  int height = 0;
+  std::vector<Color> albedo;
+  std::vector<Vector> normal;
+  std::vector<double> depth;
+
+  feature_buffers() {}
+  feature_buffers(int w, int h)
+      : width(w), height(h), albedo(w * h), normal(w * h), depth(w * h) {}
+};
+
+// Traces only the camera rays of the first `samples` samples of every pixel.
+// These are the same rays the beauty render starts from, so edges in the
+// features line up with edges in the image.
+inline feature_buffers render_features(const Scene &scene, const Camera &cam,
+                                       const Sampler &sampler,
+                                       const render_settings &settings,
+                                       int samples) {
+  feature_buffers f(settings.image_width, settings.image_height);
+  samples = std::max(samples, 1);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int j = 0; j < f.height; ++j)
+    for (int i = 0; i < f.width; ++i) {
+      auto p = j * f.width + i;
+      for (int s = 0; s < samples; ++s) {
+        sample_scope scope(sampler, i, j, s);
+        auto r = primary_ray(cam, settings, i, j);
+        hit_record rec;
+        if (scene.world->hit(r, 0.001, infinity, rec)) {
+          f.albedo[p] += rec.mat_ptr->base_color(rec);
+          f.normal[p] += rec.n;
+          f.depth[p] += rec.t * r.direction().length();
+        } else {
+          f.albedo[p] += scene.background.value(r);
+        }
+      }
+      f.albedo[p] /= samples;
+      f.normal[p] /= samples;
+      f.depth[p] /= samples;
+    }
+  return f;
+}
+
+// Features from the AOVs of a render that recorded albedo, normal and depth,
+// which saves the separate pass of render_features.
+inline feature_buffers features_from_aovs(const aov_buffers &aov) {
+  feature_buffers f(aov.width, aov.height);
+  for (int p = 0; p < aov.width * aov.height; ++p) {
+    f.albedo[p] = aov.mean(aov.albedo, p);
+    f.normal[p] = aov.mean(aov.normal, p);
+    f.depth[p] = aov.mean(aov.depth, p);
+  }
+  return f;
+}
+
+struct denoise_settings {
+  int iterations = 5;    // filter radius 2^(iterations + 1) pixels
+  float sigma_color = 4.0f; // in standard deviations of the pixel noise
+  float sigma_normal = 0.3f;
+  float sigma_depth = 0.1f; // relative to the depth of the centre pixel
+  float sigma_albedo = 0.1f;
+  int tile_size = 64;
+};
+
+// exp(-x) for x >= 0 as (1 - x/16)^16, within 0.02 of the exact value.
+// Free of library calls and comparisons (the clamp at 0 is done with fabs),
+// so loops using it vectorise.
+inline float fast_exp_neg(float x) {
+  float t = 1.f - x * (1.f / 16);
+  float y = 0.5f * (t + std::fabs(t));
+  y *= y;
+  y *= y;
+  y *= y;
+  return y * y;
+}
+
+// Albedo the colour is divided by before filtering, so that texture detail
+// is not blurred and is multiplied back in afterwards.
+inline double demodulation(const feature_buffers &f, int p, int k) {
+  return std::max(f.albedo[p][k], 1e-3);
+}
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010). Every
+// iteration applies the 5x5 B3 spline kernel with holes of 2^i pixels and
+// weights each tap by how close its colour, normal, depth and albedo are to
+// the centre pixel's, so the filter smooths noise within surfaces but not
+// across edges or texture detail. As in SVGF (Schied et al. 2017) colour
+// differences are measured against the estimated noise of the two pixels,
+// and the variance is filtered along with the colour so the colour weight
+// tightens as the noise goes down.
+//
+// The filter runs on the resolved mean colour divided by the albedo, which
+// leaves mostly the noisy lighting, and gamma encoded so that the colour
+// weight matches the output. Planes are kept as separate float arrays
+// and each tap is applied to a whole row of a tile at once, which lets the
+// compiler vectorise the inner loop. Tiles are filtered in parallel.
+//
+// Returns a copy of fb whose sums give the filtered colour.
+inline framebuffer denoise(const framebuffer &fb, const feature_buffers &f,
+                           const denoise_settings &settings = {}) {
+  const int w = fb.width, h = fb.height, n = w * h;
+  const int ts = std::max(settings.tile_size, 1);
+
+  // Structure of arrays: colour, albedo, normal and depth planes.
+  enum { R, G, B, V, AR, AG, AB, NX, NY, NZ, Z, planes };
+  std::vector<std::vector<float>> in(planes, std::vector<float>(n));
+  for (int p = 0; p < n; ++p) {
+    auto c = fb.mean(p);
+    for (int k = 0; k < 3; ++k) {
+      in[R + k][p] = std::sqrt(std::max(c[k], 0.0) / demodulation(f, p, k));
+      in[AR + k][p] = f.albedo[p][k];
+      in[NX + k][p] = f.normal[p][k];
+    }
+    in[Z][p] = f.depth[p];
+
+    // Variance of the pixel's mean luminance, carried through the square
+    // root and the demodulation to first order.
+    auto n_p = static_cast<double>(fb.count[p]);
+    auto lum = framebuffer::luminance(c);
+    auto var = n_p > 1 ? std::max(0.0, (fb.sum_lum2[p] - lum * lum * n_p) /
+                                           (n_p - 1) / n_p)
+                       : 0.0;
+    in[V][p] = var / (4 * std::max(lum, 1e-4) *
+                      std::max(framebuffer::luminance(f.albedo[p]), 1e-3));
+  }
+
+  // A few samples give a poor variance estimate, so blur it a little.
+  {
+    std::vector<float> v(n);
+    for (int y = 0; y < h; ++y)
+      for (int x = 0; x < w; ++x) {
+        float sum = 0;
+        for (int dy = -1; dy <= 1; ++dy)
+          for (int dx = -1; dx <= 1; ++dx)
+            sum += in[V][std::clamp(y + dy, 0, h - 1) * w +
+                         std::clamp(x + dx, 0, w - 1)];
+        v[y * w + x] = sum / 9;
+      }
+    in[V] = std::move(v);
+  }
+  std::vector<std::vector<float>> out(4, std::vector<float>(n));
+
+  constexpr float kernel[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+  const float inv_n2 = 1 / (settings.sigma_normal * settings.sigma_normal);
+  const float inv_a2 = 1 / (settings.sigma_albedo * settings.sigma_albedo);
+  const float inv_z = 1 / settings.sigma_depth;
+  const int tiles_x = (w + ts - 1) / ts, tiles_y = (h + ts - 1) / ts;
+
+  for (int it = 0; it < settings.iterations; ++it) {
+    const int step = 1 << it;
+    const float sigma_c2 = settings.sigma_color * settings.sigma_color;
+    const float *r = in[R].data(), *g = in[G].data(), *b = in[B].data();
+    const float *v = in[V].data();
+    const float *ar = in[AR].data(), *ag = in[AG].data(),
+                *ab = in[AB].data();
+    const float *nx = in[NX].data(), *ny = in[NY].data(),
+                *nz = in[NZ].data();
+    const float *z = in[Z].data();
+
+#pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int ty = 0; ty < tiles_y; ++ty)
+      for (int tx = 0; tx < tiles_x; ++tx) {
+        const int x0 = tx * ts, x1 = std::min(w, x0 + ts);
+        const int y0 = ty * ts, y1 = std::min(h, y0 + ts);
+        std::vector<float> acc(5 * ts);
+        float *sr = &acc[0], *sg = &acc[ts], *sb = &acc[2 * ts],
+              *sv = &acc[3 * ts], *sw = &acc[4 * ts];
+
+        for (int y = y0; y < y1; ++y) {
+          std::fill(acc.begin(), acc.end(), 0.f);
+          const int row = y * w;
+
+          for (int ky = -2; ky <= 2; ++ky) {
+            const int qrow = std::clamp(y + ky * step, 0, h - 1) * w;
+            for (int kx = -2; kx <= 2; ++kx) {
+              const float k = kernel[ky + 2] * kernel[kx + 2];
+              const int dx = kx * step;
+              auto tap = [=](int x, int q) {
+                const int p = row + x;
+                const float dr = r[p] - r[q], dg = g[p] - g[q],
+                            db = b[p] - b[q];
+                const float dar = ar[p] - ar[q], dag = ag[p] - ag[q],
+                            dab = ab[p] - ab[q];
+                const float dnx = nx[p] - nx[q], dny = ny[p] - ny[q],
+                            dnz = nz[p] - nz[q];
+                // |zp - zq| / max(zp, zq), without a comparison.
+                const float dz =
+                    2 * std::fabs(z[p] - z[q]) /
+                    (z[p] + z[q] + std::fabs(z[p] - z[q]) + 2e-4f);
+                const float e = (dr * dr + dg * dg + db * db) /
+                                    (sigma_c2 * (v[p] + v[q]) + 1e-6f) +
+                                (dnx * dnx + dny * dny + dnz * dnz) * inv_n2 +
+                                (dar * dar + dag * dag + dab * dab) * inv_a2 +
+                                dz * inv_z;
+                const float wq = k * fast_exp_neg(e);
+                sr[x - x0] += wq * r[q];
+                sg[x - x0] += wq * g[q];
+                sb[x - x0] += wq * b[q];
+                sv[x - x0] += wq * wq * v[q];
+                sw[x - x0] += wq;
+              };
+
+              // Taps inside the image read contiguous memory; only those
+              // clamped at the left and right edge need per pixel indices.
+              const int xa = std::clamp(-dx, x0, x1);
+              const int xb = std::clamp(w - dx, xa, x1);
+              for (int x = x0; x < xa; ++x)
+                tap(x, qrow + std::clamp(x + dx, 0, w - 1));
+#pragma omp simd
+              for (int x = xa; x < xb; ++x)
+                tap(x, qrow + x + dx);
+              for (int x = xb; x < x1; ++x)
+                tap(x, qrow + std::clamp(x + dx, 0, w - 1));
+            }
+          }
+
+          // The centre tap has weight k > 0, so sw is never zero.
+          for (int x = x0; x < x1; ++x) {
+            out[0][row + x] = sr[x - x0] / sw[x - x0];
+            out[1][row + x] = sg[x - x0] / sw[x - x0];
+            out[2][row + x] = sb[x - x0] / sw[x - x0];
+            out[3][row + x] = sv[x - x0] / (sw[x - x0] * sw[x - x0]);
+          }
+        }
+      }
+
+    std::swap(in[R], out[0]);
+    std::swap(in[G], out[1]);
+    std::swap(in[B], out[2]);
+    std::swap(in[V], out[3]);
+  }
+
+  framebuffer result = fb;
+  for (int p = 0; p < n; ++p) {
+    Color c;
+    for (int k = 0; k < 3; ++k)
+      c[k] = in[R + k][p] * in[R + k][p] * demodulation(f, p, k);
+    result.count[p] = std::max(fb.count[p], 1U);
+    result.sum[p] = c * static_cast<double>(result.count[p]);
+  }
+  return result;
+}
+
+} // namespace raytracer
+
+#endif // DENOISE_H_
@@ -0,0 +1,382 @@
+#ifndef DISTRIBUTED_H_
+#define DISTRIBUTED_H_
+
+#include "camera.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "socket.hpp"
+#include "tile_scheduler.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+namespace raytracer {
+
+// Tile rendering across processes. A coordinator listens on a socket and
+// hands tiles of the image to worker processes that connect to it; every
+// worker has built the same scene itself and renders the tiles on all of
+// its threads. Samples are a function of the pixel and the sample index
+// only, so it does not matter which worker renders a tile, and the result
+// equals a local render.
+//
+// Protocol, one message per step (see message_header):
+//   worker -> hello  {magic, key, threads}
+//   coord  -> job    {tile, until}           (up to job_depth outstanding)
+//   worker -> result {tile, until, sums, lum2 sums, counts of the tile}
+//   coord  -> bye                            when the image is complete
+// The key is the fingerprint of scene, camera and settings; workers whose
+// key differs are turned away.
+enum dist_message : uint32_t {
+  dist_hello = 1,
+  dist_job = 2,
+  dist_result = 3,
+  dist_bye = 4
+};
+
+constexpr char dist_magic[8] = {'R', 'T', 'D', 'I', 'S', 'T', '0', '1'};
+
+// Bytes put_tile writes for a tile of width x height pixels.
+inline size_t tile_bytes(int width, int height) {
+  return static_cast<size_t>(width) * height *
+         (sizeof(Color) + sizeof(double) + sizeof(uint32_t));
+}
+
+// Sums, luminance sums and counts of the pixels of tile t, row by row.
+inline void put_tile(payload_writer &out, const framebuffer &fb,
+                     const tile &t) {
+  const size_t n = t.x1 - t.x0;
+  for (int j = t.y0; j < t.y1; ++j)
+    out.put(&fb.sum[j * fb.width + t.x0], n * sizeof(Color));
+  for (int j = t.y0; j < t.y1; ++j)
+    out.put(&fb.sum_lum2[j * fb.width + t.x0], n * sizeof(double));
+  for (int j = t.y0; j < t.y1; ++j)
+    out.put(&fb.count[j * fb.width + t.x0], n * sizeof(uint32_t));
+}
+
+// Reads what put_tile wrote into fb. Returns false if the payload is short
+// or the tile does not fit.
+inline bool get_tile(payload_reader &in, framebuffer &fb, const tile &t) {
+  if (t.x0 < 0 || t.y0 < 0 || t.x1 > fb.width || t.y1 > fb.height ||
+      t.x0 > t.x1 || t.y0 > t.y1)
+    return false;
+  const size_t n = t.x1 - t.x0;
+  bool ok = true;
+  for (int j = t.y0; j < t.y1 && ok; ++j)
+    ok = in.get(&fb.sum[j * fb.width + t.x0], n * sizeof(Color));
+  for (int j = t.y0; j < t.y1 && ok; ++j)
+    ok = in.get(&fb.sum_lum2[j * fb.width + t.x0], n * sizeof(double));
+  for (int j = t.y0; j < t.y1 && ok; ++j)
+    ok = in.get(&fb.count[j * fb.width + t.x0], n * sizeof(uint32_t));
+  return ok;
+}
+
+struct distributed_settings {
+  int tile_size = 64;        // coordinator tiles, split again by workers
+  int job_depth = 2;         // tiles in flight per worker, hides latency
+  double slow_factor = 4;    // reissue tiles taking this many mean tile times
+  double idle_timeout = 60;  // seconds to wait with no worker connected
+  bool progress = true;
+};
+
+struct distributed_stats {
+  int workers = 0;    // that connected and said hello
+  int lost = 0;       // that disconnected before the end
+  int reissued = 0;   // tiles handed to a second worker because of a slow one
+  int duplicates = 0; // results that arrived for finished tiles
+};
+
+// Renders samples up to `until` into every pixel of fb with the workers
+// that connect to listen_fd. Tiles of workers that disconnect go back into
+// the queue; once the queue is empty, idle workers also take over tiles
+// that have been out much longer than the mean, and the first result wins.
+// Returns false if no worker was connected for idle_timeout seconds.
+inline bool render_distributed(int listen_fd, uint64_t key, framebuffer &fb,
+                               uint32_t until,
+                               const distributed_settings &settings,
+                               distributed_stats &stats) {
+  using clock = std::chrono::steady_clock;
+  auto tiles = make_tiles(fb.width, fb.height, settings.tile_size);
+  std::deque<int> queue;
+  for (size_t k = 0; k < tiles.size(); ++k)
+    queue.push_back(static_cast<int>(k));
+  std::vector<char> done(tiles.size(), 0);
+  std::vector<int> copies(tiles.size(), 0); // workers rendering the tile
+  size_t remaining = tiles.size();
+
+  struct job {
+    int tile;
+    clock::time_point issued;
+  };
+  struct worker {
+    socket_fd fd;
+    bool ready = false; // said hello with the right key
+    std::vector<job> jobs;
+    message_buffer in; // the message arriving from the worker
+  };
+  std::vector<worker> workers;
+  double tile_seconds = 0; // total over finished tiles
+  int tiles_timed = 0;
+  auto idle_since = clock::now();
+
+  auto drop = [&](worker &w) {
+    if (w.ready)
+      ++stats.lost;
+    for (auto &j : w.jobs)
+      if (--copies[j.tile] == 0 && !done[j.tile])
+        queue.push_front(j.tile);
+    w.jobs.clear();
+    w.fd.close();
+  };
+
+  // Next tile for worker w: a queued one, or else the oldest tile another
+  // worker has had for much longer than tiles take on average.
+  auto next_tile = [&](const worker &w) -> int {
+    while (!queue.empty()) {
+      int t = queue.front();
+      queue.pop_front();
+      if (!done[t])
+        return t;
+    }
+    if (tiles_timed == 0)
+      return -1;
+    const auto limit = settings.slow_factor * tile_seconds / tiles_timed;
+    const auto now = clock::now();
+    int best = -1;
+    double oldest = limit;
+    for (const auto &other : workers)
+      for (const auto &j : other.jobs) {
+        auto age = std::chrono::duration<double>(now - j.issued).count();
+        if (&other != &w && !done[j.tile] && copies[j.tile] == 1 &&
+            age > oldest) {
+          best = j.tile;
+          oldest = age;
+        }
+      }
+    if (best >= 0)
+      ++stats.reissued;
+    return best;
+  };
+
+  std::vector<char> payload;
+  const size_t max_result_bytes =
+      sizeof(tile) + sizeof(until) +
+      tile_bytes(std::min(settings.tile_size, fb.width),
+                 std::min(settings.tile_size, fb.height));
+  auto limit = [&](uint32_t type) -> size_t {
+    if (type == dist_hello)
+      return sizeof(dist_magic) + sizeof(key) + sizeof(int32_t);
+    return type == dist_result ? max_result_bytes : 0;
+  };
+  size_t reported = tiles.size() + 1;
+  while (remaining > 0) {
+    // Keep every worker busy.
+    for (auto &w : workers) {
+      while (w.fd && w.ready &&
+             static_cast<int>(w.jobs.size()) < settings.job_depth) {
+        int t = next_tile(w);
+        if (t < 0)
+          break;
+        payload.clear();
+        payload_writer(payload).put(tiles[t]).put(until);
+        ++copies[t];
+        w.jobs.push_back({t, clock::now()});
+        if (!send_message(w.fd.get(), dist_job, payload.data(),
+                          payload.size()))
+          drop(w);
+      }
+    }
+    workers.erase(std::remove_if(workers.begin(), workers.end(),
+                                 [](const worker &w) { return !w.fd; }),
+                  workers.end());
+
+    if (workers.empty()) {
+      if (std::chrono::duration<double>(clock::now() - idle_since).count() >
+          settings.idle_timeout) {
+        std::cerr << "ERROR: No render workers connected for "
+                  << settings.idle_timeout << " seconds.\n";
+        return false;
+      }
+    } else {
+      idle_since = clock::now();
+    }
+
+    std::vector<pollfd> fds{{listen_fd, POLLIN, 0}};
+    for (auto &w : workers)
+      fds.push_back({w.fd.get(), POLLIN, 0});
+    if (::poll(fds.data(), fds.size(), 100) < 0)
+      continue;
+
+    if (fds[0].revents & POLLIN) {
+      socket_fd fd(::accept(listen_fd, nullptr, nullptr));
+      if (fd) {
+        workers.emplace_back();
+        workers.back().fd = std::move(fd);
+      }
+    }
+
+    for (size_t k = 1; k < fds.size(); ++k) {
+      if (!fds[k].revents)
+        continue;
+      // Only what has arrived is read, so a worker that stalls partway
+      // through a message does not hold up the others; its tiles go to
+      // idle workers once they are overdue.
+      auto &w = workers[k - 1];
+      if (!w.in.fill(w.fd.get(), limit)) {
+        drop(w);
+        continue;
+      }
+      if (!w.in.complete())
+        continue;
+      uint32_t type = 0;
+      w.in.take(type, payload);
+      payload_reader in(payload);
+
+      if (type == dist_hello && !w.ready) {
+        char magic[8];
+        uint64_t their_key = 0;
+        int32_t threads = 0;
+        if (!in.get(magic) || std::memcmp(magic, dist_magic, 8) ||
+            !in.get(their_key) || !in.get(threads) || their_key != key) {
+          std::cerr << "\nWorker rejected: different scene or settings.\n";
+          drop(w);
+          continue;
+        }
+        w.ready = true;
+        ++stats.workers;
+      } else if (type == dist_result && w.ready) {
+        tile t;
+        uint32_t samples = 0;
+        if (!in.get(t) || !in.get(samples) || samples != until) {
+          drop(w);
+          continue;
+        }
+        auto it = std::find_if(w.jobs.begin(), w.jobs.end(), [&](const job &j) {
+          const auto &u = tiles[j.tile];
+          return u.x0 == t.x0 && u.y0 == t.y0 && u.x1 == t.x1 && u.y1 == t.y1;
+        });
+        if (it == w.jobs.end()) {
+          drop(w);
+          continue;
+        }
+        const int index = it->tile;
+        tile_seconds +=
+            std::chrono::duration<double>(clock::now() - it->issued).count();
+        ++tiles_timed;
+        --copies[index];
+        w.jobs.erase(it);
+        if (done[index]) {
+          ++stats.duplicates;
+          continue;
+        }
+        if (!get_tile(in, fb, t)) {
+          queue.push_front(index);
+          drop(w);
+          continue;
+        }
+        done[index] = 1;
+        --remaining;
+      } else {
+        drop(w);
+      }
+    }
+
+    if (settings.progress && remaining != reported) {
+      reported = remaining;
+      std::cerr << "\rTiles: " << tiles.size() - remaining << "/"
+                << tiles.size() << ", " << workers.size() << " workers   "
+                << std::flush;
+    }
+  }
+
+  for (auto &w : workers)
+    if (w.fd)
+      send_message(w.fd.get(), dist_bye, nullptr, 0);
+  return true;
+}
+
+// Worker side: connects to the coordinator at address, then renders the
+// tiles it is sent, split into parts of at most settings.tile_size on the
+// threads of settings.pool, until the coordinator says bye or goes away. Returns
+// false if it could not connect or was turned away.
+inline bool run_render_worker(const socket_address &address, uint64_t key,
+                              const Scene &scene, const Camera &cam,
+                              const Sampler &sampler,
+                              const render_settings &settings,
+                              double connect_seconds = 30) {
+  auto fd = connect_to(address, connect_seconds);
+  if (!fd) {
+    std::cerr << "ERROR: Could not connect to the coordinator.\n";
+    return false;
+  }
+  std::vector<char> payload;
+  payload_writer(payload).put(dist_magic).put(key).put(
+      static_cast<int32_t>(render_threads(settings)));
+  if (!send_message(fd.get(), dist_hello, payload.data(), payload.size()))
+    return false;
+
+  framebuffer fb(settings.image_width, settings.image_height);
+  for (;;) {
+    uint32_t type = 0;
+    if (!receive_message(fd.get(), type, payload, [](uint32_t type) {
+          return type == dist_job ? sizeof(tile) + sizeof(uint32_t) : 0;
+        }))
+      return false;
+    if (type == dist_bye)
+      return true;
+    payload_reader in(payload);
+    tile t;
+    uint32_t until = 0;
+    if (type != dist_job || !in.get(t) || !in.get(until) || t.x0 < 0 ||
+        t.y0 < 0 || t.x1 > fb.width || t.y1 > fb.height) {
+      std::cerr << "ERROR: Bad message from the coordinator.\n";
+      return false;
+    }
+
+    // A tile may come again after a reissue; start it from scratch.
+    for (int j = t.y0; j < t.y1; ++j)
+      for (int i = t.x0; i < t.x1; ++i) {
+        auto p = j * fb.width + i;
+        fb.sum[p] = Color(0, 0, 0);
+        fb.sum_lum2[p] = 0;
+        fb.count[p] = 0;
+      }
+    // Parts small enough to keep every thread busy.
+    const int threads = render_threads(settings);
+    int ts = std::max(settings.tile_size, 1);
+    while (ts > 4 && ((t.x1 - t.x0 + ts - 1) / ts) *
+                             ((t.y1 - t.y0 + ts - 1) / ts) <
+                         4 * threads)
+      ts /= 2;
+    auto parts = make_tiles(t.x1 - t.x0, t.y1 - t.y0, ts);
+    for (auto &part : parts) {
+      part.x0 += t.x0;
+      part.x1 += t.x0;
+      part.y0 += t.y0;
+      part.y1 += t.y0;
+    }
+    parallel_tiles(settings.pool, parts, [&](const tile &part, int thread) {
+      render_tile(scene, cam, sampler, settings, fb, part.x0, part.y0,
+                  part.x1, part.y1, until, tile_counters(settings, thread));
+    });
+
+    payload.clear();
+    payload_writer out(payload);
+    out.put(t).put(until);
+    put_tile(out, fb, t);
+    if (!send_message(fd.get(), dist_result, payload.data(), payload.size()))
+      return false;
+  }
+}
+
+} // namespace raytracer
+
+#endif // DISTRIBUTED_H_
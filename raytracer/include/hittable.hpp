@@ -9,6 +9,8 @@
 namespace raytracer {
 
 class material;
+class hittable;
+class replica_map;
 
 struct hit_record {
   Point p;
@@ -18,6 +20,8 @@ struct hit_record {
   bool front_face;
   double u;
   double v;
+  // Primitive that was hit, for object ID output.
+  const hittable *object = nullptr;
 
   inline void set_face_normal(const Ray &r, const Vector &outward_normal) {
     front_face = dot(r.direction(), outward_normal) < 0;
@@ -31,6 +35,32 @@ public:
                    hit_record &rec) const = 0;
   virtual bool bounding_box(double time0, double time1,
                             aabb &output_box) const = 0;
+
+  // Solid angle density with which random() picks direction v from o, for
+  // objects that can be sampled as lights.
+  virtual double pdf_value(const Point &o, const Vector &v) const {
+    return 0.0;
+  }
+
+  // Direction from o towards the object, from two uniform values in [0,1).
+  virtual Vector random(const Point &o, double u1, double u2) const {
+    return Vector(1, 0, 0);
+  }
+
+  // How far the object moves between time0 and time1, for motion vectors.
+  virtual Vector displacement(double time0, double time1) const {
+    return Vector(0, 0, 0);
+  }
+
+  // Whether the bounds change with time. Animations keep objects that do
+  // not in a BVH built once and refit only the others between frames.
+  virtual bool animated() const { return false; }
+
+  // Copy allocated by the calling thread, for scene replication across NUMA
+  // nodes, or null if the object is shared instead.
+  virtual shared_ptr<hittable> replicate(replica_map &map) const {
+    return nullptr;
+  }
 };
 
 } // namespace raytracer
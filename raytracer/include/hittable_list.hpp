@@ -4,6 +4,7 @@
 #include "hittable.hpp"
 #include "rtweekend.hpp"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -23,6 +24,11 @@ public:
   virtual bool bounding_box(double time0, double time1,
                             aabb &output_box) const override;
 
+  // Mixture of the objects' densities, each picked with equal probability.
+  virtual double pdf_value(const Point &o, const Vector &v) const override;
+
+  virtual Vector random(const Point &o, double u1, double u2) const override;
+
 public:
   std::vector<shared_ptr<hittable>> objects;
 };
@@ -62,5 +68,23 @@ inline bool hittable_list::bounding_box(double time0, double time1,
   return true;
 }
 
+inline double hittable_list::pdf_value(const Point &o, const Vector &v) const {
+  if (objects.empty())
+    return 0.0;
+
+  auto sum = 0.0;
+  for (const auto &object : objects)
+    sum += object->pdf_value(o, v);
+  return sum / objects.size();
+}
+
+inline Vector hittable_list::random(const Point &o, double u1,
+                                    double u2) const {
+  // u1 picks the object and is then rescaled to [0,1) for the object.
+  auto n = objects.size();
+  auto k = std::min(static_cast<size_t>(u1 * n), n - 1);
+  return objects[k]->random(o, std::min(u1 * n - k, 1 - 0x1.0p-53), u2);
+}
+
 } // namespace raytracer
 #endif
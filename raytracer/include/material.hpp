@@ -7,9 +7,13 @@
 #include "stb_image_write.h"
 
 #include "hittable.hpp"
+#include "onb.hpp"
 #include "perlin.hpp"
+#include "replicate.hpp"
 #include "rtweekend.hpp"
 
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 
@@ -18,6 +22,12 @@ namespace raytracer {
 class texture {
 public:
   virtual Color value(double u, double v, const Point &p) const = 0;
+
+  // Copy allocated by the calling thread, or null to share this one. See
+  // hittable::replicate.
+  virtual shared_ptr<texture> replicate(replica_map &map) const {
+    return nullptr;
+  }
 };
 
 class solid_color : public texture {
@@ -30,6 +40,10 @@ public:
     return color_value;
   }
 
+  virtual shared_ptr<texture> replicate(replica_map &map) const override {
+    return make_shared<solid_color>(*this);
+  }
+
 private:
   Color color_value;
 };
@@ -65,6 +79,10 @@ public:
       return even->value(u, v, p);
   }
 
+  virtual shared_ptr<texture> replicate(replica_map &map) const override {
+    return make_shared<checker_texture>(map.get(even), map.get(odd));
+  }
+
 public:
   shared_ptr<texture> odd;
   shared_ptr<texture> even;
@@ -74,6 +92,39 @@ class material {
 public:
   virtual bool scatter(const Ray &r_in, const hit_record &rec, Color &att,
                        Ray &scattered) const = 0;
+
+  virtual Color emitted(double u, double v, const Point &p) const {
+    return Color(0, 0, 0);
+  }
+
+  // Reflectance at the hit point, for the feature buffers that guide the
+  // denoiser.
+  virtual Color base_color(const hit_record &rec) const {
+    return Color(1, 1, 1);
+  }
+
+  // Materials with a smooth BSDF that can be evaluated for any direction;
+  // only those take part in explicit light sampling.
+  virtual bool is_diffuse() const { return false; }
+
+  // BSDF times the cosine to the normal, for light leaving along
+  // `direction` towards r_in.
+  virtual Color eval(const Ray &r_in, const hit_record &rec,
+                     const Vector &direction) const {
+    return Color(0, 0, 0);
+  }
+
+  // Solid angle density with which scatter() picks `direction`.
+  virtual double scattering_pdf(const Ray &r_in, const hit_record &rec,
+                                const Vector &direction) const {
+    return 0;
+  }
+
+  // Copy allocated by the calling thread, or null to share this one. See
+  // hittable::replicate.
+  virtual shared_ptr<material> replicate(replica_map &map) const {
+    return nullptr;
+  }
 };
 
 class lambertian : public material {
@@ -83,17 +134,40 @@ public:
 
   virtual bool scatter(const Ray &r_in, const hit_record &rec,
                        Color &attenuation, Ray &scattered) const override {
-    auto scatter_direction = rec.n + random_unit_vector<DataType>();
-
-    // Catch degenerate scatter direction
-    if (scatter_direction.near_zero())
-      scatter_direction = rec.n;
+    auto u1 = random_draw<double>();
+    auto u2 = random_draw<double>();
+    auto scatter_direction =
+        onb(rec.n).local(sample_cosine_hemisphere(u1, u2));
 
     scattered = Ray(rec.p, scatter_direction, r_in.time());
     attenuation = albedo->value(rec.u, rec.v, rec.p);
     return true;
   }
 
+  virtual bool is_diffuse() const override { return true; }
+
+  virtual Color base_color(const hit_record &rec) const override {
+    return albedo->value(rec.u, rec.v, rec.p);
+  }
+
+  virtual Color eval(const Ray &r_in, const hit_record &rec,
+                     const Vector &direction) const override {
+    auto cosine = dot(rec.n, unit_vector(direction));
+    if (cosine <= 0)
+      return Color(0, 0, 0);
+    return albedo->value(rec.u, rec.v, rec.p) * (cosine / pi);
+  }
+
+  virtual double scattering_pdf(const Ray &r_in, const hit_record &rec,
+                                const Vector &direction) const override {
+    auto cosine = dot(rec.n, unit_vector(direction));
+    return cosine <= 0 ? 0 : cosine / pi;
+  }
+
+  virtual shared_ptr<material> replicate(replica_map &map) const override {
+    return make_shared<lambertian>(map.get(albedo));
+  }
+
 public:
   shared_ptr<texture> albedo;
 };
@@ -111,6 +185,14 @@ public:
     return (dot(scattered.direction(), rec.n) > 0);
   }
 
+  virtual Color base_color(const hit_record &rec) const override {
+    return albedo;
+  }
+
+  virtual shared_ptr<material> replicate(replica_map &map) const override {
+    return make_shared<metal>(*this);
+  }
+
 public:
   Color albedo;
   double fuzz;
@@ -142,6 +224,10 @@ public:
     return true;
   }
 
+  virtual shared_ptr<material> replicate(replica_map &map) const override {
+    return make_shared<dielectric>(*this);
+  }
+
 private:
   double ir; // Index of Refraction
 
@@ -153,6 +239,28 @@ private:
   }
 };
 
+class diffuse_light : public material {
+public:
+  diffuse_light(shared_ptr<texture> a) : emit(a) {}
+  diffuse_light(Color c) : emit(make_shared<solid_color>(c)) {}
+
+  virtual bool scatter(const Ray &r_in, const hit_record &rec,
+                       Color &attenuation, Ray &scattered) const override {
+    return false;
+  }
+
+  virtual Color emitted(double u, double v, const Point &p) const override {
+    return emit->value(u, v, p);
+  }
+
+  virtual shared_ptr<material> replicate(replica_map &map) const override {
+    return make_shared<diffuse_light>(map.get(emit));
+  }
+
+public:
+  shared_ptr<texture> emit;
+};
+
 class image_texture : public texture {
 public:
   const static int bytes_per_pixel = 3;
@@ -174,7 +282,19 @@ public:
     bytes_per_scanline = bytes_per_pixel * width;
   }
 
-  ~image_texture() { delete data; }
+  image_texture(const image_texture &other)
+      : data(nullptr), width(other.width), height(other.height),
+        bytes_per_scanline(other.bytes_per_scanline) {
+    if (other.data) {
+      size_t size = static_cast<size_t>(bytes_per_scanline) * height;
+      data = static_cast<unsigned char *>(std::malloc(size));
+      std::memcpy(data, other.data, size);
+    }
+  }
+
+  image_texture &operator=(const image_texture &) = delete;
+
+  ~image_texture() { stbi_image_free(data); }
 
   virtual Color value(double u, double v, const Vector &p) const override {
     // If we have no texture data, then return solid cyan as a debugging aid.
@@ -201,6 +321,12 @@ public:
                  color_scale * pixel[2]);
   }
 
+  // The pixels are the largest read-only data of most scenes, so copies for
+  // other NUMA nodes get their own.
+  virtual shared_ptr<texture> replicate(replica_map &map) const override {
+    return make_shared<image_texture>(*this);
+  }
+
 private:
   unsigned char *data;
   int width, height;
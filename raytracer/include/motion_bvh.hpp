@@ -0,0 +1,275 @@
+#ifndef MOTION_BVH_H_
+#define MOTION_BVH_H_
+
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "rtweekend.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+namespace raytracer {
+
+// BVH for scenes with motion blur. Every node keeps its bounds at shutter
+// open (box0) and close (box1) and traversal blends them to the ray time, so
+// a fast moving object only occupies the space it covers at that instant
+// instead of the whole smear of the union box.
+class motion_bvh_node : public hittable {
+public:
+  // Per object bounds, computed once before the build.
+  struct build_entry {
+    shared_ptr<hittable> object;
+    aabb box0;
+    aabb box1;
+    Point centroid; // at the middle of the interval
+  };
+
+  motion_bvh_node(std::vector<build_entry> &entries, size_t start, size_t end,
+                  double time0, double time1);
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   hit_record &rec) const override;
+
+  virtual bool bounding_box(double _time0, double _time1,
+                            aabb &output_box) const override;
+
+  aabb box_at(double time) const;
+
+  // Recomputes the bounds for the interval [time0, time1], keeping the tree.
+  void refit(double _time0, double _time1);
+
+  // Bounds of an object at time0 and time1 that blend conservatively over
+  // the interval. Objects whose motion bends within it, such as keyframed
+  // ones, get their bounds over the whole interval at both ends.
+  static void object_bounds(const hittable &object, double time0,
+                            double time1, aabb &box0, aabb &box1);
+
+public:
+  shared_ptr<hittable> left;
+  shared_ptr<hittable> right;
+  aabb box0, box1;
+  double time0, time1;
+  int axis;
+};
+
+inline aabb motion_bvh_node::box_at(double time) const {
+  if (time1 <= time0)
+    return box0;
+  return lerp(box0, box1, clamp((time - time0) / (time1 - time0), 0.0, 1.0));
+}
+
+inline bool motion_bvh_node::bounding_box(double _time0, double _time1,
+                                          aabb &output_box) const {
+  output_box = surrounding_box(box_at(_time0), box_at(_time1));
+  return true;
+}
+
+inline void motion_bvh_node::object_bounds(const hittable &object,
+                                          double time0, double time1,
+                                          aabb &box0, aabb &box1) {
+  aabb all;
+  if (!object.bounding_box(time0, time0, box0) ||
+      !object.bounding_box(time1, time1, box1) ||
+      !object.bounding_box(time0, time1, all))
+    std::cerr << "No bounding box for a motion_bvh object.\n";
+  auto ends = surrounding_box(box0, box1);
+  for (int a = 0; a < 3; ++a)
+    if (all.min()[a] < ends.min()[a] || all.max()[a] > ends.max()[a]) {
+      box0 = box1 = all;
+      return;
+    }
+}
+
+inline void motion_bvh_node::refit(double _time0, double _time1) {
+  time0 = _time0;
+  time1 = _time1;
+  auto child_bounds = [&](const shared_ptr<hittable> &child, aabb &b0,
+                          aabb &b1) {
+    if (auto node = dynamic_cast<motion_bvh_node *>(child.get())) {
+      node->refit(time0, time1);
+      b0 = node->box0;
+      b1 = node->box1;
+    } else {
+      object_bounds(*child, time0, time1, b0, b1);
+    }
+  };
+  aabb l0, l1, r0, r1;
+  child_bounds(left, l0, l1);
+  if (left == right) {
+    box0 = l0;
+    box1 = l1;
+    return;
+  }
+  child_bounds(right, r0, r1);
+  box0 = surrounding_box(l0, r0);
+  box1 = surrounding_box(l1, r1);
+}
+
+inline bool motion_bvh_node::hit(const Ray &r, double t_min, double t_max,
+                                 hit_record &rec) const {
+  if (!box_at(r.time()).hit(r, t_min, t_max))
+    return false;
+
+  if (left == right)
+    return left->hit(r, t_min, t_max, rec);
+
+  // Visit the child on the near side of the split first so that a hit there
+  // shrinks t_max for the far one.
+  const auto &first = r.direction()[axis] < 0 ? right : left;
+  const auto &second = r.direction()[axis] < 0 ? left : right;
+
+  bool hit_first = first->hit(r, t_min, t_max, rec);
+  bool hit_second = second->hit(r, t_min, hit_first ? rec.t : t_max, rec);
+
+  return hit_first || hit_second;
+}
+
+inline motion_bvh_node::motion_bvh_node(std::vector<build_entry> &entries,
+                                        size_t start, size_t end,
+                                        double _time0, double _time1)
+    : time0(_time0), time1(_time1), axis(0) {
+  // Split along the axis with the largest centroid spread.
+  Point lo = entries[start].centroid;
+  Point hi = entries[start].centroid;
+  for (size_t i = start + 1; i < end; ++i) {
+    for (int a = 0; a < 3; ++a) {
+      lo[a] = fmin(lo[a], entries[i].centroid[a]);
+      hi[a] = fmax(hi[a], entries[i].centroid[a]);
+    }
+  }
+  Vector extent = hi - lo;
+  if (extent.y() > extent[axis])
+    axis = 1;
+  if (extent.z() > extent[axis])
+    axis = 2;
+
+  size_t object_span = end - start;
+
+  if (object_span == 1) {
+    left = right = entries[start].object;
+    box0 = entries[start].box0;
+    box1 = entries[start].box1;
+    return;
+  }
+
+  auto mid = start + object_span / 2;
+  std::nth_element(entries.begin() + start, entries.begin() + mid,
+                   entries.begin() + end,
+                   [axis = axis](const build_entry &a, const build_entry &b) {
+                     return a.centroid[axis] < b.centroid[axis];
+                   });
+
+  shared_ptr<motion_bvh_node> l, r;
+  if (mid - start == 1) {
+    left = entries[start].object;
+  } else {
+    l = make_shared<motion_bvh_node>(entries, start, mid, time0, time1);
+    left = l;
+  }
+  if (end - mid == 1) {
+    right = entries[mid].object;
+  } else {
+    r = make_shared<motion_bvh_node>(entries, mid, end, time0, time1);
+    right = r;
+  }
+
+  // Blending the children's endpoint boxes is conservative for any child
+  // whose own bounds move linearly, which holds for everything in here.
+  aabb l0 = l ? l->box0 : entries[start].box0;
+  aabb l1 = l ? l->box1 : entries[start].box1;
+  aabb r0 = r ? r->box0 : entries[mid].box0;
+  aabb r1 = r ? r->box1 : entries[mid].box1;
+  box0 = surrounding_box(l0, r0);
+  box1 = surrounding_box(l1, r1);
+}
+
+// Top level motion BVH. With segments > 1 the shutter interval is cut into
+// equal slices with their own tree each, so objects whose motion is not
+// linear over the full interval are still bounded tightly within a slice.
+class motion_bvh : public hittable {
+public:
+  motion_bvh(const hittable_list &list, double _time0, double _time1,
+             int segments = 1)
+      : time0(_time0), time1(_time1) {
+    if (list.objects.empty())
+      return;
+    if (segments < 1)
+      segments = 1;
+    for (int k = 0; k < segments; ++k) {
+      auto t0 = time0 + (time1 - time0) * k / segments;
+      auto t1 = time0 + (time1 - time0) * (k + 1) / segments;
+      auto entries = make_entries(list, t0, t1);
+      roots.push_back(
+          make_shared<motion_bvh_node>(entries, 0, entries.size(), t0, t1));
+    }
+  }
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   hit_record &rec) const override {
+    if (roots.empty())
+      return false;
+    return segment(r.time())->hit(r, t_min, t_max, rec);
+  }
+
+  // Moves the tree to the interval [time0, time1] by recomputing its bounds
+  // bottom up, without the sorting of a rebuild. The split planes stay those
+  // of the build, so the tree stays good while objects move little relative
+  // to each other, as between the frames of an animation.
+  void refit(double _time0, double _time1) {
+    time0 = _time0;
+    time1 = _time1;
+    const int segments = static_cast<int>(roots.size());
+    for (int k = 0; k < segments; ++k)
+      roots[k]->refit(time0 + (time1 - time0) * k / segments,
+                      time0 + (time1 - time0) * (k + 1) / segments);
+  }
+
+  virtual bool bounding_box(double _time0, double _time1,
+                            aabb &output_box) const override {
+    if (roots.empty())
+      return false;
+    aabb box;
+    segment(_time0)->bounding_box(_time0, _time0, output_box);
+    for (const auto &root : roots) {
+      if (root->time1 <= _time0 || root->time0 >= _time1)
+        continue;
+      root->bounding_box(fmax(_time0, root->time0), fmin(_time1, root->time1),
+                         box);
+      output_box = surrounding_box(output_box, box);
+    }
+    return true;
+  }
+
+private:
+  std::vector<shared_ptr<motion_bvh_node>> roots;
+  double time0, time1;
+
+  const shared_ptr<motion_bvh_node> &segment(double time) const {
+    if (roots.size() == 1 || time1 <= time0)
+      return roots.front();
+    auto k = static_cast<int>((time - time0) / (time1 - time0) * roots.size());
+    return roots[std::clamp(k, 0, static_cast<int>(roots.size()) - 1)];
+  }
+
+  static std::vector<motion_bvh_node::build_entry>
+  make_entries(const hittable_list &list, double t0, double t1) {
+    std::vector<motion_bvh_node::build_entry> entries;
+    entries.reserve(list.objects.size());
+    for (const auto &object : list.objects) {
+      motion_bvh_node::build_entry e;
+      e.object = object;
+      aabb mid;
+      motion_bvh_node::object_bounds(*object, t0, t1, e.box0, e.box1);
+      if (!object->bounding_box(0.5 * (t0 + t1), 0.5 * (t0 + t1), mid))
+        std::cerr << "No bounding box in motion_bvh constructor.\n";
+      e.centroid = 0.5 * (mid.min() + mid.max());
+      entries.push_back(e);
+    }
+    return entries;
+  }
+};
+
+} // namespace raytracer
+#endif // MOTION_BVH_H_
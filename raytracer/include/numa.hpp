@@ -0,0 +1,131 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace raytracer {
+
+// How a Renderer uses the NUMA nodes of the machine.
+enum class numa_mode {
+  off,      // threads float, one shared scene
+  pin,      // threads pinned to nodes, tiles scheduled per node
+  replicate // as pin, and every node renders from its own copy of the scene
+};
+
+// Parses a kernel CPU list such as "0-3,8-11". Returns an empty list if the
+// text is malformed.
+inline std::vector<int> parse_cpu_list(const std::string &text) {
+  std::vector<int> cpus;
+  std::stringstream ss(text);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range == "\n")
+      continue;
+    int first = 0, last = 0;
+    char dash = 0;
+    std::stringstream rs(range);
+    if (!(rs >> first))
+      return {};
+    last = first;
+    if (rs >> dash && (dash != '-' || !(rs >> last)))
+      return {};
+    for (int cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+// CPUs of every NUMA node, as listed under /sys/devices/system/node. On
+// machines without that directory, or other systems, all CPUs form one node.
+struct numa_topology {
+  std::vector<std::vector<int>> nodes;
+
+  int size() const { return static_cast<int>(nodes.size()); }
+
+  static numa_topology detect() {
+    numa_topology topology;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (online && std::getline(online, list))
+      for (int node : parse_cpu_list(list)) {
+        std::ifstream file("/sys/devices/system/node/node" +
+                           std::to_string(node) + "/cpulist");
+        std::string cpus;
+        if (file && std::getline(file, cpus) && !parse_cpu_list(cpus).empty())
+          topology.nodes.push_back(parse_cpu_list(cpus));
+      }
+    if (topology.nodes.empty()) {
+      topology.nodes.emplace_back();
+      int n = std::max(1U, std::thread::hardware_concurrency());
+      for (int cpu = 0; cpu < n; ++cpu)
+        topology.nodes.back().push_back(cpu);
+    }
+    return topology;
+  }
+};
+
+// Restricts the calling thread to the given CPUs. Returns false where that
+// is not supported or the CPUs are not available to the process.
+inline bool pin_thread(const std::vector<int> &cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof set, &set) == 0;
+#else
+  return false;
+#endif
+}
+
+// CPUs the calling thread may run on, empty where that is not known.
+inline std::vector<int> thread_cpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof set, &set) == 0)
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &set))
+        cpus.push_back(cpu);
+#endif
+  return cpus;
+}
+
+// Pins the calling thread to cpus for the lifetime of the scope, then gives
+// it back the CPUs it had. Does nothing for an empty list.
+class pin_scope {
+public:
+  explicit pin_scope(const std::vector<int> &cpus) {
+    if (cpus.empty())
+      return;
+    saved = thread_cpus();
+    if (!saved.empty())
+      pin_thread(cpus);
+  }
+
+  ~pin_scope() {
+    if (!saved.empty())
+      pin_thread(saved);
+  }
+
+  pin_scope(const pin_scope &) = delete;
+  pin_scope &operator=(const pin_scope &) = delete;
+
+private:
+  std::vector<int> saved;
+};
+
+} // namespace raytracer
+
+#endif // NUMA_H_
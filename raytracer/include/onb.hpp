@@ -0,0 +1,30 @@
+#ifndef ONB_H_
+#define ONB_H_
+
+#include "rtweekend.hpp"
+
+namespace raytracer {
+
+// Orthonormal basis with w along a given direction.
+class onb {
+public:
+  onb(const Vector &n) {
+    w = unit_vector(n);
+    Vector a = (fabs(w.x()) > 0.9) ? Vector(0, 1, 0) : Vector(1, 0, 0);
+    v = unit_vector(cross(w, a));
+    u = cross(w, v);
+  }
+
+  Vector local(double a, double b, double c) const {
+    return a * u + b * v + c * w;
+  }
+
+  Vector local(const Vector &a) const { return local(a.x(), a.y(), a.z()); }
+
+public:
+  Vector u, v, w;
+};
+
+} // namespace raytracer
+
+#endif // ONB_H_
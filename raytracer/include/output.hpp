@@ -0,0 +1,482 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include "aov.hpp"
+#include "color.hpp"
+#include "render.hpp"
+#include "rtweekend.hpp"
+#include "tonemap.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace raytracer {
+
+// Resolves fb to each pixel's mean radiance as linear float RGB, rows from
+// the top down unless top_down is false. Pixels without samples are black.
+inline void resolve_linear(const framebuffer &fb, float *rgb,
+                           bool top_down = true) {
+  for (int j = 0; j < fb.height; ++j) {
+    auto *row = rgb + static_cast<size_t>(top_down ? fb.height - 1 - j : j) *
+                          fb.width * 3;
+    for (int i = 0; i < fb.width; ++i) {
+      auto c = fb.mean(j * fb.width + i);
+      for (int k = 0; k < 3; ++k)
+        row[i * 3 + k] = static_cast<float>(c[k]);
+    }
+  }
+}
+
+inline std::vector<float> resolve_linear(const framebuffer &fb,
+                                         bool top_down = true) {
+  std::vector<float> rgb(static_cast<size_t>(fb.width) * fb.height * 3);
+  resolve_linear(fb, rgb.data(), top_down);
+  return rgb;
+}
+
+// Resolves fb to 8 bit RGB into rgb, rows from the top down, tonemapped as
+// set by tonemap. By default each pixel's mean is clamped to [0, 1) and
+// encoded with gamma 2.
+inline void resolve_rgb8(const framebuffer &fb, uint8_t *rgb,
+                         const tonemap_settings &tonemap = {}) {
+  auto linear = resolve_linear(fb);
+  tonemap_rgb8(linear.data(), linear.size(), tonemap, rgb);
+}
+
+inline std::vector<uint8_t> resolve_rgb8(const framebuffer &fb,
+                                         const tonemap_settings &tonemap = {}) {
+  std::vector<uint8_t> rgb(static_cast<size_t>(fb.width) * fb.height * 3);
+  resolve_rgb8(fb, rgb.data(), tonemap);
+  return rgb;
+}
+
+// Encodes a resolved framebuffer into an image file format. Writers build
+// the file in memory and hand it to the stream in one write. 8 bit formats
+// are tonemapped; float formats hold the linear radiance, so that they can
+// be tonemapped again later without rendering.
+class image_writer {
+public:
+  virtual ~image_writer() = default;
+
+  // File name extension, without the dot.
+  virtual const char *extension() const = 0;
+
+  virtual bool write(std::ostream &out, const framebuffer &fb) const = 0;
+};
+
+// Binary PPM (P6).
+class ppm_writer : public image_writer {
+public:
+  explicit ppm_writer(const tonemap_settings &_tonemap = {})
+      : tonemap(_tonemap) {}
+
+  virtual const char *extension() const override { return "ppm"; }
+
+  virtual bool write(std::ostream &out,
+                     const framebuffer &fb) const override {
+    auto header = "P6\n" + std::to_string(fb.width) + ' ' +
+                  std::to_string(fb.height) + "\n255\n";
+    std::vector<char> file(header.size() +
+                           static_cast<size_t>(fb.width) * fb.height * 3);
+    std::copy(header.begin(), header.end(), file.begin());
+    resolve_rgb8(fb, reinterpret_cast<uint8_t *>(file.data()) + header.size(),
+                 tonemap);
+    return static_cast<bool>(out.write(file.data(), file.size()));
+  }
+
+private:
+  tonemap_settings tonemap;
+};
+
+// Headerless 8 bit RGB, rows from the top down.
+class raw_writer : public image_writer {
+public:
+  explicit raw_writer(const tonemap_settings &_tonemap = {})
+      : tonemap(_tonemap) {}
+
+  virtual const char *extension() const override { return "raw"; }
+
+  virtual bool write(std::ostream &out,
+                     const framebuffer &fb) const override {
+    auto rgb = resolve_rgb8(fb, tonemap);
+    return static_cast<bool>(
+        out.write(reinterpret_cast<const char *>(rgb.data()), rgb.size()));
+  }
+
+private:
+  tonemap_settings tonemap;
+};
+
+// PNG or JPEG through stb_image_write.
+class stb_writer : public image_writer {
+public:
+  explicit stb_writer(bool _jpeg, const tonemap_settings &_tonemap = {},
+                      int _quality = 90)
+      : jpeg(_jpeg), tonemap(_tonemap), quality(_quality) {}
+
+  virtual const char *extension() const override {
+    return jpeg ? "jpg" : "png";
+  }
+
+  virtual bool write(std::ostream &out,
+                     const framebuffer &fb) const override {
+    auto rgb = resolve_rgb8(fb, tonemap);
+    std::vector<char> file;
+    bool encoded =
+        jpeg ? stbi_write_jpg_to_func(append, &file, fb.width, fb.height, 3,
+                                      rgb.data(), quality)
+             : stbi_write_png_to_func(append, &file, fb.width, fb.height, 3,
+                                      rgb.data(), fb.width * 3);
+    return encoded && out.write(file.data(), file.size());
+  }
+
+  // stb_image_write callback appending to a std::vector<char>.
+  static void append(void *context, void *data, int size) {
+    auto &file = *static_cast<std::vector<char> *>(context);
+    auto bytes = static_cast<const char *>(data);
+    file.insert(file.end(), bytes, bytes + size);
+  }
+
+private:
+  bool jpeg;
+  tonemap_settings tonemap;
+  int quality;
+};
+
+// Portable float map of the linear radiance, rows from the bottom up.
+// Little endian hosts only.
+class pfm_writer : public image_writer {
+public:
+  virtual const char *extension() const override { return "pfm"; }
+
+  virtual bool write(std::ostream &out,
+                     const framebuffer &fb) const override {
+    auto header = "PF\n" + std::to_string(fb.width) + ' ' +
+                  std::to_string(fb.height) + "\n-1.0\n";
+    auto rgb = resolve_linear(fb, false);
+    return out.write(header.data(), header.size()) &&
+           out.write(reinterpret_cast<const char *>(rgb.data()),
+                     rgb.size() * sizeof(float));
+  }
+};
+
+// Radiance RGBE (.hdr) of the linear radiance through stb_image_write.
+class hdr_writer : public image_writer {
+public:
+  virtual const char *extension() const override { return "hdr"; }
+
+  virtual bool write(std::ostream &out,
+                     const framebuffer &fb) const override {
+    auto rgb = resolve_linear(fb);
+    std::vector<char> file;
+    return stbi_write_hdr_to_func(stb_writer::append, &file, fb.width,
+                                  fb.height, 3, rgb.data()) &&
+           out.write(file.data(), file.size());
+  }
+};
+
+// OpenEXR of the linear radiance: 32 bit float B, G and R channels,
+// uncompressed, one scanline per block. Little endian hosts only.
+class exr_writer : public image_writer {
+public:
+  virtual const char *extension() const override { return "exr"; }
+
+  virtual bool write(std::ostream &out,
+                     const framebuffer &fb) const override {
+    const int w = fb.width, h = fb.height;
+    auto rgb = resolve_linear(fb);
+    std::vector<char> file;
+    auto put = [&](const void *data, size_t size) {
+      auto bytes = static_cast<const char *>(data);
+      file.insert(file.end(), bytes, bytes + size);
+    };
+    auto put_int = [&](int32_t v) { put(&v, sizeof v); };
+    auto put_float = [&](float v) { put(&v, sizeof v); };
+    auto attribute = [&](const char *name, const char *type, int32_t size) {
+      put(name, std::strlen(name) + 1);
+      put(type, std::strlen(type) + 1);
+      put_int(size);
+    };
+
+    put_int(20000630); // magic number
+    put_int(2);        // version 2, single part scanline file
+    attribute("channels", "chlist", 3 * 18 + 1);
+    for (auto name : {"B", "G", "R"}) {
+      put(name, 2);
+      put_int(2); // FLOAT
+      put_int(0); // pLinear and reserved
+      put_int(1); // x sampling
+      put_int(1); // y sampling
+    }
+    file.push_back(0);
+    attribute("compression", "compression", 1);
+    file.push_back(0); // NO_COMPRESSION
+    for (auto window : {"dataWindow", "displayWindow"}) {
+      attribute(window, "box2i", 16);
+      for (int32_t v : {0, 0, w - 1, h - 1})
+        put_int(v);
+    }
+    attribute("lineOrder", "lineOrder", 1);
+    file.push_back(0); // INCREASING_Y
+    attribute("pixelAspectRatio", "float", 4);
+    put_float(1);
+    attribute("screenWindowCenter", "v2f", 8);
+    put_float(0);
+    put_float(0);
+    attribute("screenWindowWidth", "float", 4);
+    put_float(1);
+    file.push_back(0); // end of header
+
+    const int32_t block = w * 3 * sizeof(float);
+    uint64_t offset = file.size() + h * sizeof(uint64_t);
+    for (int y = 0; y < h; ++y, offset += 8 + block)
+      put(&offset, sizeof offset);
+    file.reserve(offset);
+    std::vector<float> channel(w);
+    for (int y = 0; y < h; ++y) {
+      put_int(y);
+      put_int(block);
+      const float *row = rgb.data() + static_cast<size_t>(y) * w * 3;
+      for (int k = 2; k >= 0; --k) {
+        for (int x = 0; x < w; ++x)
+          channel[x] = row[x * 3 + k];
+        put(channel.data(), channel.size() * sizeof(float));
+      }
+    }
+    return static_cast<bool>(out.write(file.data(), file.size()));
+  }
+};
+
+// Writer by name or file extension: ppm, png, jpg (or jpeg) or raw, which
+// are tonemapped as set by tonemap, or pfm, hdr or exr. Returns nullptr for
+// unknown names.
+inline std::shared_ptr<image_writer>
+make_image_writer(const std::string &name,
+                  const tonemap_settings &tonemap = {}) {
+  if (name == "ppm")
+    return std::make_shared<ppm_writer>(tonemap);
+  if (name == "png")
+    return std::make_shared<stb_writer>(false, tonemap);
+  if (name == "jpg" || name == "jpeg")
+    return std::make_shared<stb_writer>(true, tonemap);
+  if (name == "raw")
+    return std::make_shared<raw_writer>(tonemap);
+  if (name == "pfm")
+    return std::make_shared<pfm_writer>();
+  if (name == "hdr")
+    return std::make_shared<hdr_writer>();
+  if (name == "exr")
+    return std::make_shared<exr_writer>();
+  return nullptr;
+}
+
+// Writer for the extension of path, PPM if it has no known one.
+inline std::shared_ptr<image_writer>
+image_writer_for(const std::string &path,
+                 const tonemap_settings &tonemap = {}) {
+  auto dot = path.rfind('.');
+  auto slash = path.rfind('/');
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    if (auto writer = make_image_writer(path.substr(dot + 1), tonemap))
+      return writer;
+  return make_image_writer("ppm", tonemap);
+}
+
+inline bool write_ppm(std::ostream &out, const framebuffer &fb) {
+  return ppm_writer().write(out, fb);
+}
+
+// Per pixel sample counts as an ASCII PGM in the pixel order of the image
+// writers, for renders that do not give every pixel the same number of
+// samples.
+inline void write_sample_counts(std::ostream &out, const framebuffer &fb) {
+  uint32_t max = 1;
+  for (auto c : fb.count)
+    max = std::max(max, c);
+
+  out << "P2\n"
+      << "# samples per pixel\n"
+      << fb.width << ' ' << fb.height << '\n'
+      << max << '\n';
+  for (int j = fb.height - 1; j >= 0; --j)
+    for (int i = 0; i < fb.width; ++i)
+      out << fb.count[j * fb.width + i] << (i + 1 < fb.width ? ' ' : '\n');
+}
+
+// Writes to a temporary file next to `path` through writer(out), which
+// returns whether it succeeded, and renames it into place, so readers never
+// see a partly written file. On failure the temporary file is removed and
+// `path` left as it was.
+template <typename Writer>
+inline bool write_atomic(const std::string &path, Writer writer) {
+  auto tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out) {
+      std::cerr << "ERROR: Could not open '" << tmp << "' for writing.\n";
+      return false;
+    }
+    if (!writer(out) || !out.flush()) {
+      out.close();
+      std::remove(tmp.c_str());
+      std::cerr << "ERROR: Could not write '" << tmp << "'.\n";
+      return false;
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::cerr << "ERROR: Could not rename '" << tmp << "' to '" << path
+              << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+inline bool write_image(const std::string &path, const framebuffer &fb,
+                        const image_writer &writer) {
+  return write_atomic(
+      path, [&](std::ostream &out) { return writer.write(out, fb); });
+}
+
+// Writes fb to standard output, with a message on failure.
+inline bool write_to_stdout(const image_writer &writer, const framebuffer &fb) {
+  if (writer.write(std::cout, fb) && std::cout.flush())
+    return true;
+  std::cerr << "ERROR: Could not write the image to standard output.\n";
+  return false;
+}
+
+// Writes fb in the format of path's extension.
+inline bool write_image(const std::string &path, const framebuffer &fb) {
+  return write_image(path, fb, *image_writer_for(path));
+}
+
+inline bool write_ppm(const std::string &path, const framebuffer &fb) {
+  return write_image(path, fb, ppm_writer());
+}
+
+inline bool write_sample_counts(const std::string &path,
+                                const framebuffer &fb) {
+  return write_atomic(path, [&](std::ostream &out) {
+    write_sample_counts(out, fb);
+    return static_cast<bool>(out);
+  });
+}
+
+// Reads a PFM or Radiance .hdr image, as written by pfm_writer and
+// hdr_writer, into fb as one sample per pixel, so that it can be written
+// again with other tonemap settings.
+inline bool read_linear_image(const std::string &path, framebuffer &fb) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::cerr << "ERROR: Could not open '" << path << "'.\n";
+    return false;
+  }
+  std::string magic;
+  int w = 0, h = 0;
+  double scale = 0;
+  std::vector<float> rgb;
+  bool bottom_up = true;
+  if (in >> magic && magic == "PF") {
+    if (!(in >> w >> h >> scale) || w <= 0 || h <= 0 || w > 1 << 15 ||
+        h > 1 << 15 || scale >= 0) {
+      std::cerr << "ERROR: '" << path
+                << "' is not a little endian RGB float map.\n";
+      return false;
+    }
+    in.get();
+    rgb.resize(static_cast<size_t>(w) * h * 3);
+    if (!in.read(reinterpret_cast<char *>(rgb.data()),
+                 rgb.size() * sizeof(float))) {
+      std::cerr << "ERROR: '" << path << "' is truncated.\n";
+      return false;
+    }
+  } else {
+    int channels = 0;
+    float *data = stbi_is_hdr(path.c_str())
+                      ? stbi_loadf(path.c_str(), &w, &h, &channels, 3)
+                      : nullptr;
+    if (!data) {
+      std::cerr << "ERROR: '" << path << "' is not a PFM or HDR image.\n";
+      return false;
+    }
+    rgb.assign(data, data + static_cast<size_t>(w) * h * 3);
+    stbi_image_free(data);
+    bottom_up = false;
+  }
+
+  fb = framebuffer(w, h);
+  for (int j = 0; j < h; ++j)
+    for (int i = 0; i < w; ++i) {
+      const float *c = rgb.data() +
+                        (static_cast<size_t>(bottom_up ? j : h - 1 - j) * w + i) * 3;
+      fb.add(j * w + i, Color(c[0], c[1], c[2]));
+    }
+  return true;
+}
+
+// Portable float map: channels 1 (Pf) or 3 (PF), little endian, rows from
+// the bottom up like framebuffer.
+inline void write_pfm(std::ostream &out, int width, int height, int channels,
+                      const std::vector<float> &data) {
+  out << (channels == 3 ? "PF" : "Pf") << '\n'
+      << width << ' ' << height << '\n'
+      << "-1.0\n";
+  out.write(reinterpret_cast<const char *>(data.data()),
+            data.size() * sizeof(float));
+}
+
+// Writes the AOVs of fb selected by flags to `base`.NAME.pfm. Albedo, normal and
+// depth are averaged over the pixel's samples, the object ID is that of its
+// first sample.
+inline bool write_aovs(const std::string &base, const framebuffer &fb,
+                       unsigned flags) {
+  const auto &aov = fb.aov;
+  const int n = aov.width * aov.height;
+  bool ok = true;
+  for (auto flag : all_aovs) {
+    if (!(aov.enabled & flags & flag))
+      continue;
+    int channels = flag == aov_depth || flag == aov_object_id ? 1 : 3;
+    std::vector<float> data(n * channels);
+    for (int p = 0; p < n; ++p) {
+      Vector v;
+      switch (flag) {
+      case aov_albedo:
+        v = aov.mean(aov.albedo, p);
+        break;
+      case aov_normal:
+        v = aov.mean(aov.normal, p);
+        break;
+      case aov_depth:
+        v[0] = aov.mean(aov.depth, p);
+        break;
+      case aov_object_id:
+        v[0] = aov.object_id[p];
+        break;
+      case aov_motion:
+        v = aov.mean(aov.motion, p);
+        break;
+      }
+      for (int c = 0; c < channels; ++c)
+        data[p * channels + c] = static_cast<float>(v[c]);
+    }
+    auto path = base + "." + aov_name(flag) + ".pfm";
+    ok &= write_atomic(path, [&](std::ostream &out) {
+      write_pfm(out, aov.width, aov.height, channels, data);
+      return static_cast<bool>(out);
+    });
+  }
+  return ok;
+}
+
+} // namespace raytracer
+
+#endif // OUTPUT_H_
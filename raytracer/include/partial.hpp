@@ -0,0 +1,177 @@
+#ifndef PARTIAL_H_
+#define PARTIAL_H_
+
+#include "output.hpp"
+#include "render.hpp"
+#include "rtweekend.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace raytracer {
+
+// Half-open range [first, end) of sample indices.
+struct sample_range {
+  uint32_t first = 0;
+  uint32_t end = 0;
+};
+
+// Accumulation buffers of a render over some sample index ranges, which
+// merge with those of other ranges of the same render. With
+// render_settings::exact_sums, the default, K partials of S samples at
+// offsets 0, S, ... merge to exactly the buffers of one run of K * S
+// samples.
+struct partial_result {
+  framebuffer fb;
+  uint64_t key = 0; // fingerprint of scene, camera, settings and seed
+  std::vector<sample_range> ranges;
+  bool variance = true; // whether fb.sum_lum2 is kept
+
+  uint32_t samples() const {
+    uint32_t n = 0;
+    for (const auto &r : ranges)
+      n += r.end - r.first;
+    return n;
+  }
+};
+
+// File layout: the header, the sample ranges, then per pixel the sums as
+// doubles, the counts and, if flagged, the sums of squared luminance.
+// Doubles rather than floats keep the sums exact.
+struct partial_header {
+  char magic[8] = {'R', 'T', 'P', 'A', 'R', 'T', '0', '1'};
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint64_t key = 0;
+  uint32_t variance = 0;
+  uint32_t ranges = 0;
+};
+
+// Partial result of fb, whose pixels must all hold the samples from
+// sample_offset on. Fails, with a message, otherwise.
+inline bool make_partial(const framebuffer &fb, uint64_t key,
+                         uint32_t sample_offset, partial_result &partial) {
+  const auto n = fb.count.empty() ? 0 : fb.count.front();
+  if (std::any_of(fb.count.begin(), fb.count.end(),
+                  [n](uint32_t c) { return c != n; })) {
+    std::cerr << "ERROR: Partial results need the same number of samples in "
+                 "every pixel.\n";
+    return false;
+  }
+  partial.fb = fb;
+  partial.fb.aov = aov_buffers();
+  partial.key = key;
+  partial.ranges.clear();
+  if (n > 0)
+    partial.ranges.push_back({sample_offset, sample_offset + n});
+  partial.variance = true;
+  return true;
+}
+
+// Adds from to into. Both must belong to the same render and cover
+// disjoint sample ranges; merging a range twice would weight it double.
+inline bool merge_partial(partial_result &into, const partial_result &from) {
+  if (into.fb.width != from.fb.width || into.fb.height != from.fb.height ||
+      into.key != from.key) {
+    std::cerr << "ERROR: Partial results of different scenes, cameras or "
+                 "settings cannot be merged.\n";
+    return false;
+  }
+  auto ranges = into.ranges;
+  ranges.insert(ranges.end(), from.ranges.begin(), from.ranges.end());
+  std::sort(ranges.begin(), ranges.end(),
+            [](const sample_range &a, const sample_range &b) {
+              return a.first < b.first;
+            });
+  std::vector<sample_range> merged;
+  for (const auto &r : ranges) {
+    if (!merged.empty() && r.first < merged.back().end) {
+      std::cerr << "ERROR: Partial results overlap in samples "
+                << std::max(r.first, merged.back().first) << " to "
+                << std::min(r.end, merged.back().end) - 1 << ".\n";
+      return false;
+    }
+    if (!merged.empty() && r.first == merged.back().end)
+      merged.back().end = r.end;
+    else
+      merged.push_back(r);
+  }
+
+  for (size_t p = 0; p < into.fb.sum.size(); ++p) {
+    into.fb.sum[p] += from.fb.sum[p];
+    into.fb.sum_lum2[p] += from.fb.sum_lum2[p];
+    into.fb.count[p] += from.fb.count[p];
+  }
+  into.ranges = std::move(merged);
+  into.variance = into.variance && from.variance;
+  return true;
+}
+
+inline bool save_partial(const std::string &path,
+                         const partial_result &partial) {
+  partial_header header;
+  header.width = partial.fb.width;
+  header.height = partial.fb.height;
+  header.key = partial.key;
+  header.variance = partial.variance;
+  header.ranges = partial.ranges.size();
+
+  return write_atomic(path, [&](std::ostream &out) {
+    const auto &fb = partial.fb;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(partial.ranges.data()),
+              partial.ranges.size() * sizeof(sample_range));
+    out.write(reinterpret_cast<const char *>(fb.sum.data()),
+              fb.sum.size() * sizeof(Color));
+    out.write(reinterpret_cast<const char *>(fb.count.data()),
+              fb.count.size() * sizeof(uint32_t));
+    if (partial.variance)
+      out.write(reinterpret_cast<const char *>(fb.sum_lum2.data()),
+                fb.sum_lum2.size() * sizeof(double));
+    return static_cast<bool>(out);
+  });
+}
+
+inline bool load_partial(const std::string &path, partial_result &partial) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::cerr << "ERROR: Could not open '" << path << "'.\n";
+    return false;
+  }
+  partial_header header, expected;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || std::memcmp(header.magic, expected.magic, sizeof(header.magic)) ||
+      header.width > 1 << 15 || header.height > 1 << 15 ||
+      header.ranges > 1 << 20) {
+    std::cerr << "ERROR: '" << path << "' is not a partial result.\n";
+    return false;
+  }
+  partial.fb = framebuffer(header.width, header.height);
+  partial.key = header.key;
+  partial.variance = header.variance;
+  partial.ranges.resize(header.ranges);
+  auto &fb = partial.fb;
+  in.read(reinterpret_cast<char *>(partial.ranges.data()),
+          partial.ranges.size() * sizeof(sample_range));
+  in.read(reinterpret_cast<char *>(fb.sum.data()),
+          fb.sum.size() * sizeof(Color));
+  in.read(reinterpret_cast<char *>(fb.count.data()),
+          fb.count.size() * sizeof(uint32_t));
+  if (partial.variance)
+    in.read(reinterpret_cast<char *>(fb.sum_lum2.data()),
+            fb.sum_lum2.size() * sizeof(double));
+  if (!in) {
+    std::cerr << "ERROR: Partial result '" << path << "' is truncated.\n";
+    return false;
+  }
+  return true;
+}
+
+} // namespace raytracer
+
+#endif // PARTIAL_H_
@@ -82,7 +82,7 @@ private:
 
   static void permute(int *p, int n) {
     for (int i = n - 1; i > 0; i--) {
-      int target = random_draw<int>(0, i);
+      int target = random_draw<int>(0, i + 1);
       int tmp = p[i];
       p[i] = p[target];
       p[target] = tmp;
@@ -0,0 +1,140 @@
+#ifndef RANDOM_H_
+#define RANDOM_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace raytracer {
+
+// splitmix64, used to expand a single seed into generator state.
+inline uint64_t splitmix64(uint64_t &x) {
+  uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// xoshiro256+ by Blackman and Vigna. The low bits are weak, so only the high
+// bits are used when converting to floating point.
+class xoshiro256plus {
+public:
+  xoshiro256plus(uint64_t seed = 0) { this->seed(seed); }
+
+  // Seed from a single value and move to the given stream. Streams are
+  // 2^128 draws apart and therefore never overlap.
+  void seed(uint64_t seed, uint64_t stream = 0) {
+    for (auto &word : s)
+      word = splitmix64(seed);
+    for (uint64_t i = 0; i < stream; ++i)
+      jump();
+  }
+
+  uint64_t next() {
+    const uint64_t result = s[0] + s[3];
+    const uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+  }
+
+  // Advance by 2^128 draws.
+  void jump() {
+    static constexpr uint64_t JUMP[] = {0x180ec6d33cfd0abaULL,
+                                        0xd5a61266f0c9392cULL,
+                                        0xa9582618e03fc9aaULL,
+                                        0x39abdc4529b1661cULL};
+    uint64_t t[4] = {0, 0, 0, 0};
+    for (auto jump : JUMP)
+      for (int b = 0; b < 64; ++b) {
+        if (jump & (uint64_t{1} << b))
+          for (int i = 0; i < 4; ++i)
+            t[i] ^= s[i];
+        next();
+      }
+    for (int i = 0; i < 4; ++i)
+      s[i] = t[i];
+  }
+
+  // Uniform in [0,1). Integers come from uniform_int.
+  template <typename T> T uniform() {
+    static_assert(std::is_floating_point_v<T>,
+                  "uniform() draws floating point values");
+    if constexpr (sizeof(T) == sizeof(float))
+      return static_cast<T>(next() >> 40) * T(0x1.0p-24);
+    else
+      return static_cast<T>(next() >> 11) * T(0x1.0p-53);
+  }
+
+  // Uniform integer in [min,max).
+  int uniform_int(int min, int max) {
+    auto range = static_cast<uint64_t>(static_cast<int64_t>(max) - min);
+    return min + static_cast<int>(((next() >> 32) * range) >> 32);
+  }
+
+  // Batched draws into a contiguous buffer, laid out for SIMD consumers.
+  template <typename T> void fill(T *out, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+      out[i] = uniform<T>();
+  }
+
+private:
+  uint64_t s[4];
+
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+// Philox4x32-10 by Salmon et al., a counter based generator: the output is
+// a pure function of (counter, key), so any draw can be reproduced from its
+// coordinates alone without carrying state between threads.
+inline std::array<uint32_t, 4> philox4x32(std::array<uint32_t, 4> ctr,
+                                          std::array<uint32_t, 2> key) {
+  constexpr uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+  constexpr uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+  for (int round = 0; round < 10; ++round) {
+    const uint64_t p0 = uint64_t{M0} * ctr[0];
+    const uint64_t p1 = uint64_t{M1} * ctr[2];
+    ctr = {static_cast<uint32_t>(p1 >> 32) ^ ctr[1] ^ key[0],
+           static_cast<uint32_t>(p1),
+           static_cast<uint32_t>(p0 >> 32) ^ ctr[3] ^ key[1],
+           static_cast<uint32_t>(p0)};
+    key[0] += W0;
+    key[1] += W1;
+  }
+  return ctr;
+}
+
+// 32 bit integer hash (lowbias32 by Chris Wellons).
+inline uint32_t hash32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint32_t hash32(uint32_t a, uint32_t b) {
+  return hash32(a ^ (hash32(b) + 0x9e3779b9U + (a << 6) + (a >> 2)));
+}
+
+inline uint32_t hash32(uint32_t a, uint32_t b, uint32_t c) {
+  return hash32(hash32(a, b), c);
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+  x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+  x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+} // namespace raytracer
+
+#endif // RANDOM_H_
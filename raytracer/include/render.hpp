@@ -0,0 +1,530 @@
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include "aov.hpp"
+#include "camera.hpp"
+#include "color.hpp"
+#include "rtweekend.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "telemetry.hpp"
+#include "tile_scheduler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+namespace raytracer {
+
+struct render_settings {
+  int image_width = 400;
+  int image_height = 225;
+  int samples_per_pixel = 50; // average per pixel when adaptive
+  int max_depth = 25;
+  bool progress = true;
+  int samples_per_pass = 1; // progressive rendering
+  unsigned aovs = 0;         // aov_flag bits to record
+  int tile_size = 16;
+  raytracer::tile_order tile_order = raytracer::tile_order::hilbert;
+  // Threads the passes run on; an OpenMP team if null. Set by Renderer.
+  thread_pool *pool = nullptr;
+  // Counters passes publish to, one slot per thread; none if null.
+  render_telemetry *telemetry = nullptr;
+  // Copies of the scene, one per NUMA node of pool, that threads render
+  // from instead of the scene passed in. Set by Renderer; shared, so that a
+  // render keeps its copies when the Renderer makes others.
+  std::shared_ptr<const std::vector<Scene>> scene_replicas;
+  // Index of a pixel's first sample, so that runs over disjoint index ranges
+  // can be merged (see partial.hpp).
+  uint32_t sample_offset = 0;
+  // Round samples with framebuffer::quantize, so that sums are exact and
+  // partial results merge to the very image of a single run. A single run
+  // matches only if it rounds too, so this is on unless turned off.
+  bool exact_sums = true;
+  // Set to abandon the render: tiles stop after their current row.
+  const std::atomic<bool> *cancel = nullptr;
+
+  // Adaptive sampling: samples are taken in rounds and tiles whose relative
+  // error is below adaptive_threshold stop early, leaving the budget of
+  // samples_per_pixel * pixels to the tiles with the largest error.
+  bool adaptive = false;
+  int adaptive_min_samples = 8;
+  int adaptive_max_samples = 1024;
+  int adaptive_tile_size = 8;
+  double adaptive_threshold = 0.01;
+};
+
+// Per pixel sample statistics, indexed j * width + i with row j = 0 at the
+// bottom of the image.
+struct framebuffer {
+  int width = 0;
+  int height = 0;
+  std::vector<Color> sum;
+  std::vector<double> sum_lum2; // sum of squared sample luminance
+  std::vector<uint32_t> count;
+  aov_buffers aov;
+
+  framebuffer() {}
+  framebuffer(int w, int h, unsigned aovs = 0)
+      : width(w), height(h), sum(w * h), sum_lum2(w * h), count(w * h),
+        aov(w, h, aovs) {}
+
+  void add(int p, const Color &c) {
+    auto l = luminance(c);
+    sum[p] += c;
+    sum_lum2[p] += l * l;
+    ++count[p];
+  }
+
+  // Adds c and its squared luminance rounded to multiples of 2^-20. Sums of
+  // such values stay exact in double precision up to 2^33, so they do not
+  // depend on the order in which samples are added.
+  void add_exact(int p, const Color &c) {
+    auto q = quantize(c);
+    auto l = luminance(q);
+    sum[p] += q;
+    sum_lum2[p] += quantize(l * l);
+    ++count[p];
+  }
+
+  static double quantize(double x) {
+    constexpr double scale = 1 << 20;
+    return std::nearbyint(x * scale) / scale;
+  }
+
+  static Color quantize(const Color &c) {
+    return Color(quantize(c.x()), quantize(c.y()), quantize(c.z()));
+  }
+
+  Color mean(int p) const {
+    return count[p] ? sum[p] / static_cast<double>(count[p]) : Color(0, 0, 0);
+  }
+
+  // Standard error of the mean luminance relative to the mean. The square
+  // root in the denominator matches the gamma 2 encoding of the output, so
+  // the error of dark pixels is not overstated.
+  double relative_error(int p) const {
+    auto n = static_cast<double>(count[p]);
+    if (n < 2)
+      return infinity;
+    auto mean = luminance(sum[p]) / n;
+    auto variance = std::max(0.0, (sum_lum2[p] - mean * mean * n) / (n - 1));
+    return sqrt(variance / n) / (sqrt(std::max(mean, 0.0)) + 1e-3);
+  }
+
+  uint64_t total_samples() const {
+    uint64_t total = 0;
+    for (auto c : count)
+      total += c;
+    return total;
+  }
+
+  static double luminance(const Color &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+  }
+};
+
+// Camera ray through pixel (i, j) for the sample of the enclosing
+// sample_scope.
+inline Ray primary_ray(const Camera &cam, const render_settings &settings,
+                       int i, int j) {
+  auto u = (i + sample_value(dim_pixel_x)) / (settings.image_width - 1);
+  auto v = (j + sample_value(dim_pixel_y)) / (settings.image_height - 1);
+  return cam.get_ray(u, v, sample_value(dim_lens_u), sample_value(dim_lens_v),
+                     sample_value(dim_time));
+}
+
+// Radiance of sample `s` of pixel (i, j); row j = 0 is the bottom of the
+// image. primary, if given, receives the first hit.
+inline Color render_sample(const Scene &scene, const Camera &cam,
+                           const Sampler &sampler,
+                           const render_settings &settings, int i, int j,
+                           int s, first_hit *primary = nullptr) {
+  sample_scope scope(sampler, i, j, s);
+  return ray_color(primary_ray(cam, settings, i, j), scene, settings.max_depth,
+                   primary);
+}
+
+// Adds samples up to index `until` to every pixel of a tile, continuing
+// each pixel's sample sequence where it stopped. If counters are given, the
+// work done is published to them after every row.
+inline void render_tile(const Scene &scene, const Camera &cam,
+                        const Sampler &sampler,
+                        const render_settings &settings, framebuffer &fb,
+                        int x0, int y0, int x1, int y1, uint32_t until,
+                        thread_counters *counters = nullptr) {
+  using clock = std::chrono::steady_clock;
+  auto &rays = thread_ray_counts();
+  auto row_start = counters ? clock::now() : clock::time_point();
+  for (int j = y0; j < y1; ++j) {
+    if (settings.cancel && settings.cancel->load(std::memory_order_relaxed))
+      return;
+    const auto rays0 = rays;
+    uint64_t samples = 0;
+    for (int i = x0; i < x1; ++i) {
+      auto p = j * fb.width + i;
+      for (auto s = fb.count[p]; s < until; ++s) {
+        const auto index = s + settings.sample_offset;
+        first_hit primary;
+        auto c = render_sample(scene, cam, sampler, settings, i, j, index,
+                               fb.aov.enabled ? &primary : nullptr);
+        if (settings.exact_sums)
+          fb.add_exact(p, c);
+        else
+          fb.add(p, c);
+        if (fb.aov.enabled)
+          fb.aov.add(p, primary, scene, cam);
+        ++samples;
+      }
+    }
+    if (counters) {
+      auto now = clock::now();
+      thread_counters::add(counters->pixels, x1 - x0);
+      thread_counters::add(counters->samples, samples);
+      thread_counters::add(counters->rays, rays.rays - rays0.rays);
+      thread_counters::add(counters->bounces, rays.bounces - rays0.bounces);
+      thread_counters::add(
+          counters->busy_ns,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - row_start)
+              .count());
+      row_start = now;
+    }
+  }
+}
+
+// Counters of the thread running a tile, if the render publishes any.
+inline thread_counters *tile_counters(const render_settings &settings,
+                                      int thread) {
+  return settings.telemetry && thread < settings.telemetry->threads()
+             ? &settings.telemetry->thread(thread)
+             : nullptr;
+}
+
+// Scene a thread renders from: its node's replica, if there are any.
+inline const Scene &thread_scene(const render_settings &settings,
+                                 const Scene &scene, int thread) {
+  return settings.scene_replicas && settings.pool
+             ? (*settings.scene_replicas)[settings.pool->node(thread)]
+             : scene;
+}
+
+// Threads a pass runs on.
+inline int render_threads(const render_settings &settings) {
+  return settings.pool ? settings.pool->size()
+                       : std::max(1, omp_get_max_threads());
+}
+
+inline framebuffer render_adaptive(const Scene &scene, const Camera &cam,
+                                   const Sampler &sampler,
+                                   const render_settings &settings) {
+  const int w = settings.image_width, h = settings.image_height;
+  const int ts = std::max(1, settings.adaptive_tile_size);
+  const int tiles_x = (w + ts - 1) / ts, tiles_y = (h + ts - 1) / ts;
+  const uint32_t max_spp = std::max(settings.adaptive_max_samples, 2);
+  const uint64_t budget =
+      static_cast<uint64_t>(settings.samples_per_pixel) * w * h;
+
+  // Tiles of the adaptive_tile_size grid, indexed ty * tiles_x + tx.
+  struct region {
+    int x0, y0, x1, y1;
+    uint32_t spp;  // samples every pixel of the tile has
+    uint32_t next; // samples it gets in this round
+    double error;  // largest relative error of its pixels
+  };
+  std::vector<region> regions;
+  for (int ty = 0; ty < tiles_y; ++ty)
+    for (int tx = 0; tx < tiles_x; ++tx)
+      regions.push_back({tx * ts, ty * ts, std::min(w, (tx + 1) * ts),
+                         std::min(h, (ty + 1) * ts), 0, 0, infinity});
+
+  framebuffer fb(w, h, settings.aovs);
+  uint64_t spent = 0;
+  const uint32_t first = std::min(settings.adaptive_min_samples,
+                                  settings.samples_per_pixel);
+  for (auto &r : regions)
+    r.next = std::min(std::max(first, 2U), max_spp);
+
+  for (int round = 0;; ++round) {
+    // Take this round's samples, on the same threads and scene replicas as
+    // a render_pass.
+    std::vector<tile> work;
+    for (const auto &r : regions)
+      if (r.next > r.spp)
+        work.push_back({r.x0, r.y0, r.x1, r.y1});
+    if (work.empty())
+      break;
+
+    parallel_tiles(settings.pool, work, [&](const tile &t, int thread) {
+      auto &r = regions[(t.y0 / ts) * tiles_x + t.x0 / ts];
+      render_tile(thread_scene(settings, scene, thread), cam, sampler,
+                  settings, fb, r.x0, r.y0, r.x1, r.y1, r.next,
+                  tile_counters(settings, thread));
+      r.error = 0;
+      for (int j = r.y0; j < r.y1; ++j)
+        for (int i = r.x0; i < r.x1; ++i)
+          r.error = std::max(r.error, fb.relative_error(j * w + i));
+    });
+    for (auto &r : regions)
+      if (r.next > r.spp) {
+        spent += static_cast<uint64_t>(r.next - r.spp) * (r.x1 - r.x0) *
+                 (r.y1 - r.y0);
+        r.spp = r.next;
+      }
+
+    // Hand the remaining budget to unconverged tiles, worst first. A tile
+    // asks for the samples its error predicts it needs to converge, at most
+    // doubling per round so that the estimate is refreshed.
+    std::vector<region *> active;
+    for (auto &r : regions)
+      if (r.error > settings.adaptive_threshold && r.spp < max_spp)
+        active.push_back(&r);
+    std::sort(active.begin(), active.end(),
+              [](const region *a, const region *b) {
+                return a->error > b->error;
+              });
+
+    uint64_t left = budget > spent ? budget - spent : 0;
+    for (auto *r : active) {
+      auto ratio = r->error / settings.adaptive_threshold;
+      auto wanted = static_cast<uint32_t>(std::min<double>(
+          std::ceil(r->spp * ratio * ratio), 2.0 * r->spp));
+      wanted = std::min(wanted, max_spp);
+      uint64_t pixels = (r->x1 - r->x0) * (r->y1 - r->y0);
+      uint64_t cost = (wanted - r->spp) * pixels;
+      if (cost > left) {
+        wanted = r->spp + static_cast<uint32_t>(left / pixels);
+        cost = (wanted - r->spp) * pixels;
+      }
+      r->next = wanted;
+      left -= cost;
+    }
+
+    if (settings.progress)
+      std::cerr << "\rRound " << round << ": " << active.size() << "/"
+                << regions.size() << " tiles active, "
+                << (budget ? 100 * spent / budget : 100) << "% of budget"
+                << std::flush;
+  }
+
+  return fb;
+}
+
+// Brings every pixel of fb up to `until` samples.
+inline scheduler_stats render_pass(const Scene &scene, const Camera &cam,
+                                   const Sampler &sampler,
+                                   const render_settings &settings,
+                                   framebuffer &fb, uint32_t until) {
+  auto tiles = make_tiles(fb.width, fb.height, settings.tile_size,
+                          settings.tile_order);
+  return parallel_tiles(settings.pool, tiles, [&](const tile &t, int thread) {
+    render_tile(thread_scene(settings, scene, thread), cam, sampler, settings,
+                fb, t.x0, t.y0, t.x1, t.y1, until,
+                tile_counters(settings, thread));
+  });
+}
+
+// Like render_pass, but calls on_tile(tile) on the rendering thread as soon
+// as a tile is done, for streaming results. Once on_tile returns false, or
+// settings.cancel is set, the remaining tiles are skipped. Returns whether
+// all tiles were rendered.
+template <typename Callback>
+inline bool render_tiles(const Scene &scene, const Camera &cam,
+                         const Sampler &sampler,
+                         const render_settings &settings, framebuffer &fb,
+                         uint32_t until, Callback on_tile) {
+  auto tiles = make_tiles(fb.width, fb.height, settings.tile_size,
+                          settings.tile_order);
+  std::atomic<bool> cancelled = false;
+  parallel_tiles(
+      settings.pool, tiles,
+      [&](const tile &t, int thread) {
+        render_tile(thread_scene(settings, scene, thread), cam, sampler,
+                    settings, fb, t.x0, t.y0, t.x1, t.y1, until,
+                    tile_counters(settings, thread));
+        if ((settings.cancel && settings.cancel->load()) || !on_tile(t))
+          cancelled = true;
+      },
+      [&] { return cancelled.load(std::memory_order_relaxed); });
+  return !cancelled;
+}
+
+// Renders the scene from every camera, with the same settings, into one
+// framebuffer per camera. The tiles of all views go through one scheduler,
+// interleaved so that each thread's share covers the same image region in
+// every view; the views thus keep all threads busy as one large render
+// would, and read the same geometry, BVH and textures. Adaptive sampling is
+// not supported. With settings.progress and no telemetry of the caller's,
+// progress over all views is reported.
+inline std::vector<framebuffer> render_views(const Scene &scene,
+                                             const std::vector<Camera> &cams,
+                                             const Sampler &sampler,
+                                             const render_settings &settings) {
+  std::vector<framebuffer> fbs;
+  for (size_t v = 0; v < cams.size(); ++v)
+    fbs.emplace_back(settings.image_width, settings.image_height,
+                     settings.aovs);
+  if (cams.empty())
+    return fbs;
+
+  auto view_tiles = make_tiles(settings.image_width, settings.image_height,
+                               settings.tile_size, settings.tile_order);
+  std::vector<tile> tiles;
+  tiles.reserve(view_tiles.size() * cams.size());
+  for (auto t : view_tiles)
+    for (size_t v = 0; v < cams.size(); ++v) {
+      t.view = static_cast<int>(v);
+      tiles.push_back(t);
+    }
+
+  const auto until = static_cast<uint32_t>(settings.samples_per_pixel);
+  auto run = [&](const render_settings &s) {
+    parallel_tiles(s.pool, tiles, [&](const tile &t, int thread) {
+      render_tile(thread_scene(s, scene, thread), cams[t.view], sampler, s,
+                  fbs[t.view], t.x0, t.y0, t.x1, t.y1, until,
+                  tile_counters(s, thread));
+    });
+  };
+  if (settings.progress && !settings.telemetry) {
+    render_telemetry telemetry(render_threads(settings));
+    progress_reporter reporter(telemetry,
+                               static_cast<uint64_t>(fbs[0].count.size()) *
+                                   cams.size() * until);
+    auto reported = settings;
+    reported.telemetry = &telemetry;
+    run(reported);
+  } else {
+    run(settings);
+  }
+  return fbs;
+}
+
+// Renders the full image with samples_per_pixel samples in every pixel, or
+// adaptively if settings.adaptive is set. With settings.progress and no
+// telemetry of the caller's, progress is reported while rendering.
+inline framebuffer render(const Scene &scene, const Camera &cam,
+                          const Sampler &sampler,
+                          const render_settings &settings) {
+  if (settings.adaptive)
+    return render_adaptive(scene, cam, sampler, settings);
+
+  framebuffer fb(settings.image_width, settings.image_height, settings.aovs);
+  if (settings.progress && !settings.telemetry) {
+    render_telemetry telemetry(render_threads(settings));
+    progress_reporter reporter(telemetry,
+                               static_cast<uint64_t>(fb.count.size()) *
+                                   std::max(settings.samples_per_pixel, 0));
+    auto reported = settings;
+    reported.telemetry = &telemetry;
+    render_pass(scene, cam, sampler, reported, fb,
+                settings.samples_per_pixel);
+  } else {
+    render_pass(scene, cam, sampler, settings, fb, settings.samples_per_pixel);
+  }
+  return fb;
+}
+
+// Progressive rendering: passes of samples_per_pass samples per pixel are
+// added to fb until it holds samples_per_pixel samples, or indefinitely if
+// that is 0. after_pass(fb, pass) runs after every pass and stops the render
+// by returning false. Every pixel continues its own sample sequence, so the
+// result equals a one-shot render with the same number of samples, also when
+// fb already holds samples from an earlier run.
+template <typename Callback>
+inline void render_progressive(const Scene &scene, const Camera &cam,
+                               const Sampler &sampler,
+                               const render_settings &settings,
+                               framebuffer &fb, Callback after_pass) {
+  const uint32_t total = std::max(settings.samples_per_pixel, 0);
+  const uint32_t step = std::max(settings.samples_per_pass, 1);
+  uint32_t done = fb.count.empty()
+                      ? 0
+                      : *std::min_element(fb.count.begin(), fb.count.end());
+
+  for (int pass = 0; total == 0 || done < total; ++pass) {
+    done = total == 0 ? done + step : std::min(done + step, total);
+    render_pass(scene, cam, sampler, settings, fb, done);
+    if (!after_pass(fb, pass))
+      break;
+  }
+}
+
+using render_clock = std::chrono::steady_clock;
+
+// Like render_pass, but tiles not started by the deadline are skipped.
+// Tiles are issued in interleaved order, so a pass cut short leaves an
+// evenly spread subset of the image behind. Returns whether the pass
+// completed.
+inline bool render_pass(const Scene &scene, const Camera &cam,
+                        const Sampler &sampler,
+                        const render_settings &settings, framebuffer &fb,
+                        uint32_t until, render_clock::time_point deadline) {
+  auto tiles = make_tiles(fb.width, fb.height, settings.tile_size,
+                          tile_order::interleaved);
+  std::atomic<bool> expired = false;
+  parallel_tiles(
+      settings.pool, tiles,
+      [&](const tile &t, int thread) {
+        render_tile(thread_scene(settings, scene, thread), cam, sampler,
+                    settings, fb, t.x0, t.y0, t.x1, t.y1, until,
+                    tile_counters(settings, thread));
+      },
+      [&] {
+        if (render_clock::now() < deadline)
+          return false;
+        expired = true;
+        return true;
+      });
+  return !expired;
+}
+
+// Renders into fb until `seconds` have passed, or until samples_per_pixel
+// samples if that is not 0. The first pass takes one sample per pixel and
+// measures the throughput; later passes are sized to a quarter of the time
+// left, so they shrink towards the deadline and the pass that gets cut off
+// is short. after_pass(fb, pass) runs after every completed pass and stops
+// the render by returning false. Pixels end up with different sample counts
+// when the last pass is cut, fb.count records them.
+template <typename Callback>
+inline void render_timed(const Scene &scene, const Camera &cam,
+                         const Sampler &sampler,
+                         const render_settings &settings, framebuffer &fb,
+                         double seconds, Callback after_pass) {
+  const auto start = render_clock::now();
+  const auto deadline =
+      start + std::chrono::duration_cast<render_clock::duration>(
+                  std::chrono::duration<double>(seconds));
+  const uint32_t total = std::max(settings.samples_per_pixel, 0);
+  uint32_t done = fb.count.empty()
+                      ? 0
+                      : *std::min_element(fb.count.begin(), fb.count.end());
+  uint32_t step = 1;
+
+  for (int pass = 0; total == 0 || done < total; ++pass) {
+    if (total)
+      step = std::min(step, total - done);
+    auto t0 = render_clock::now();
+    if (!render_pass(scene, cam, sampler, settings, fb, done + step, deadline))
+      break;
+    done += step;
+    if (!after_pass(fb, pass))
+      break;
+
+    auto now = render_clock::now();
+    if (now >= deadline)
+      break;
+    auto pass_time = std::chrono::duration<double>(now - t0).count();
+    auto left = std::chrono::duration<double>(deadline - now).count();
+    auto rate = step / std::max(pass_time, 1e-6); // samples per pixel per s
+    step = static_cast<uint32_t>(
+        std::clamp(std::floor(rate * left / 4), 1.0, 1e6));
+  }
+}
+
+} // namespace raytracer
+
+#endif // RENDER_H_
@@ -0,0 +1,157 @@
+#ifndef RENDER_ASYNC_H_
+#define RENDER_ASYNC_H_
+
+#include "camera.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "tile_scheduler.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+namespace raytracer {
+
+// A render running on a background thread, started by render_async(). The
+// tiles it completes can be taken in completion order with next_tile(); once
+// a tile is taken, its pixels in image() are final. Destroying the handle
+// cancels the render and waits for it.
+class render_handle {
+public:
+  render_handle(frozen_scene _scene, const Camera &_cam,
+                std::shared_ptr<const Sampler> _sampler,
+                const render_settings &_settings)
+      : scene(std::move(_scene)), cam(_cam), sampler(std::move(_sampler)),
+        settings(_settings),
+        fb(settings.image_width, settings.image_height, settings.aovs),
+        total(make_tiles(fb.width, fb.height, settings.tile_size).size()),
+        worker([this] { run(); }) {}
+
+  ~render_handle() {
+    cancel();
+    wait();
+  }
+
+  render_handle(const render_handle &) = delete;
+  render_handle &operator=(const render_handle &) = delete;
+
+  // Next completed tile, waiting for one if none is ready. Empty once the
+  // render has ended and every completed tile was taken.
+  std::optional<tile> next_tile() {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return !tiles.empty() || finished; });
+    return pop();
+  }
+
+  // Next completed tile if one is ready, without waiting.
+  std::optional<tile> try_next_tile() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pop();
+  }
+
+  // Fraction of tiles completed.
+  double progress() const {
+    return total ? static_cast<double>(completed.load()) / total : 1;
+  }
+  size_t tiles_completed() const { return completed.load(); }
+  size_t tiles_total() const { return total; }
+
+  // Stops the render. Threads give up their tile after the current row, so
+  // the render ends within the time of one tile row.
+  void cancel() { cancelled = true; }
+
+  // Waits for the render to end. Returns whether it completed every tile.
+  bool wait() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [this] { return finished; });
+    }
+    std::lock_guard<std::mutex> lock(join_mutex);
+    if (worker.joinable())
+      worker.join();
+    return complete;
+  }
+
+  bool done() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished;
+  }
+
+  // The image so far. Complete for tiles taken from the stream, and
+  // everywhere after wait() returned true.
+  const framebuffer &image() const { return fb; }
+
+private:
+  frozen_scene scene;
+  Camera cam;
+  std::shared_ptr<const Sampler> sampler;
+  render_settings settings;
+  framebuffer fb;
+  const size_t total;
+  std::atomic<size_t> completed = 0;
+  std::atomic<bool> cancelled = false;
+  mutable std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<tile> tiles;
+  bool finished = false;
+  bool complete = false;
+  std::mutex join_mutex;
+  std::thread worker; // last, so it starts after the members it uses
+
+  std::optional<tile> pop() {
+    if (tiles.empty())
+      return std::nullopt;
+    auto t = tiles.front();
+    tiles.pop_front();
+    return t;
+  }
+
+  // Renders on settings.pool with this thread as thread 0, which the pool
+  // pins to thread 0's node for the job, so that it renders that node's
+  // tiles from that node's replica in local memory.
+  void run() {
+    settings.cancel = &cancelled;
+    bool all = render_tiles(
+        *scene, cam, *sampler, settings, fb,
+        static_cast<uint32_t>(std::max(settings.samples_per_pixel, 0)),
+        [this](const tile &t) {
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            tiles.push_back(t);
+          }
+          ++completed;
+          ready.notify_all();
+          return true;
+        });
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      finished = true;
+      complete = all && completed.load() == total;
+    }
+    ready.notify_all();
+  }
+};
+
+// Starts rendering samples_per_pixel samples in every pixel in the
+// background and returns at once. The handle shares ownership of scene and
+// sampler. Threads come from settings.pool, where other jobs wait until
+// the render has ended, or else an OpenMP team. Adaptive sampling is not
+// supported.
+inline std::unique_ptr<render_handle>
+render_async(frozen_scene scene, const Camera &cam,
+             std::shared_ptr<const Sampler> sampler,
+             render_settings settings) {
+  settings.progress = false;
+  return std::make_unique<render_handle>(std::move(scene), cam,
+                                         std::move(sampler), settings);
+}
+
+} // namespace raytracer
+
+#endif // RENDER_ASYNC_H_
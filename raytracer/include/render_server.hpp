@@ -0,0 +1,285 @@
+#ifndef RENDER_SERVER_H_
+#define RENDER_SERVER_H_
+
+#include "camera.hpp"
+#include "distributed.hpp"
+#include "render.hpp"
+#include "renderer.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "scenes.hpp"
+#include "socket.hpp"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace raytracer {
+
+// A render server keeps scenes, with their textures and BVHs, loaded
+// between jobs, so a job for a scene it has seen starts tracing right away
+// instead of rebuilding everything as a fresh process must. Clients connect
+// to its socket, send one job and receive the tiles as they finish:
+//
+//   client -> job      render_job
+//   server -> accepted {setup seconds, scene cache hit}
+//   server -> tile     {tile, put_tile data}   once per tile, in any order
+//   server -> done     {render seconds}
+//   server -> error    {message}                instead of the above
+enum job_message : uint32_t {
+  job_request = 1,
+  job_accepted = 2,
+  job_tile = 3,
+  job_done = 4,
+  job_error = 5
+};
+
+constexpr char job_magic[8] = {'R', 'T', 'J', 'O', 'B', '0', '0', '1'};
+
+// Payload limits, checked before a message is read. A job holds numbers and
+// two names; errors quote a name, other replies but tiles hold numbers.
+constexpr size_t max_job_bytes = 4096;
+constexpr size_t max_reply_bytes = 2 * max_job_bytes;
+
+struct render_job {
+  std::string scene = "earth";
+  std::string sampler = "sobol";
+  uint64_t seed = 5489; // of the scene and the sampler
+  int32_t width = 400;
+  int32_t height = 225;
+  int32_t samples_per_pixel = 50;
+  int32_t max_depth = 25;
+  int32_t tile_size = 16;
+  camera_params camera;
+
+  void write(payload_writer &out) const {
+    out.put(job_magic).put(scene).put(sampler).put(seed).put(width);
+    out.put(height).put(samples_per_pixel).put(max_depth).put(tile_size);
+    out.put(camera);
+  }
+
+  bool read(payload_reader &in) {
+    char magic[8];
+    return in.get(magic) && !std::memcmp(magic, job_magic, 8) &&
+           in.get(scene) && in.get(sampler) && in.get(seed) &&
+           in.get(width) && in.get(height) && in.get(samples_per_pixel) &&
+           in.get(max_depth) && in.get(tile_size) && in.get(camera) &&
+           width > 0 && height > 0 && width <= 1 << 15 &&
+           height <= 1 << 15 && samples_per_pixel > 0 && max_depth > 0 &&
+           tile_size > 0;
+  }
+};
+
+// Bytes the process has allocated, used to weigh cache entries. Only known
+// with glibc; elsewhere every scene counts as one byte and the budget as a
+// scene count.
+inline size_t heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+// Built scenes by name and seed, least recently used first out once their
+// memory exceeds the budget. The scene just used always stays, and a scene
+// evicted while a job renders it lives on until that job is done.
+class scene_cache {
+public:
+  explicit scene_cache(size_t _budget) : budget(_budget) {}
+
+  // The scene, from the cache or built now on the calling thread with the
+  // generator state of a fresh process run with this seed. hit tells which.
+  // Null for an unknown name.
+  frozen_scene get(const std::string &name, uint64_t seed, double time0,
+                   double time1, bool &hit) {
+    auto key = name + "/" + std::to_string(seed) + "/" +
+               std::to_string(time0) + "/" + std::to_string(time1);
+    auto it = index.find(key);
+    hit = it != index.end();
+    if (hit) {
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->scene;
+    }
+
+    auto before = heap_in_use();
+    set_rng_seed(seed);
+    thread_rng().seed(seed, 0);
+    Scene built;
+    if (!make_scene(name, built))
+      return nullptr;
+    built.build(time0, time1);
+    auto scene = freeze(std::move(built));
+    auto after = heap_in_use();
+    size_t size = after > before ? after - before : 1;
+
+    lru.push_front({key, scene, size});
+    index[key] = lru.begin();
+    used += size;
+    while (used > budget && lru.size() > 1) {
+      used -= lru.back().bytes;
+      index.erase(lru.back().key);
+      lru.pop_back();
+    }
+    return scene;
+  }
+
+  size_t size() const { return lru.size(); }
+  size_t bytes() const { return used; }
+
+private:
+  struct entry {
+    std::string key;
+    frozen_scene scene;
+    size_t bytes;
+  };
+  size_t budget;
+  size_t used = 0;
+  std::list<entry> lru;
+  std::unordered_map<std::string, std::list<entry>::iterator> index;
+};
+
+// Serves one client connection: reads its job, renders it on renderer and
+// streams the tiles back as they complete. A client that goes away cancels
+// its job. Without timeouts on fd (see set_timeouts), a client that sends
+// nothing holds up the caller for good.
+inline void serve_render_job(int fd, scene_cache &cache, Renderer &renderer,
+                             bool log = true) {
+  using clock = std::chrono::steady_clock;
+  std::vector<char> payload;
+  uint32_t type = 0;
+  if (!receive_message(fd, type, payload, [](uint32_t type) -> size_t {
+        return type == job_request ? max_job_bytes : 0;
+      }))
+    return;
+  const auto start = clock::now();
+  auto fail = [&](const std::string &message) {
+    payload.clear();
+    payload_writer(payload).put(message);
+    send_message(fd, job_error, payload.data(), payload.size());
+    if (log)
+      std::cerr << "Job rejected: " << message << "\n";
+  };
+
+  render_job job;
+  payload_reader in(payload);
+  if (type != job_request || !job.read(in))
+    return fail("malformed job");
+  bool hit = false;
+  auto scene = cache.get(job.scene, job.seed, job.camera.time0,
+                         job.camera.time1, hit);
+  if (!scene)
+    return fail("unknown scene '" + job.scene + "'");
+  auto sampler = make_sampler(job.sampler, job.seed);
+  if (!sampler)
+    return fail("unknown sampler '" + job.sampler + "'");
+
+  render_settings settings;
+  settings.image_width = job.width;
+  settings.image_height = job.height;
+  settings.samples_per_pixel = job.samples_per_pixel;
+  settings.max_depth = job.max_depth;
+  settings.tile_size = job.tile_size;
+  settings.progress = false;
+  auto cam = job.camera.camera();
+
+  const double setup = std::chrono::duration<double>(clock::now() - start)
+                           .count();
+  payload.clear();
+  payload_writer(payload).put(setup).put(static_cast<uint8_t>(hit));
+  if (!send_message(fd, job_accepted, payload.data(), payload.size()))
+    return;
+
+  // Tiles are sent from this thread while the workers render on.
+  auto render = renderer.render_async(scene, cam, sampler, settings);
+  while (auto t = render->next_tile()) {
+    payload.clear();
+    payload_writer out(payload);
+    out.put(*t);
+    put_tile(out, render->image(), *t);
+    if (!send_message(fd, job_tile, payload.data(), payload.size()))
+      render->cancel();
+  }
+  const bool complete = render->wait();
+
+  const double seconds = std::chrono::duration<double>(clock::now() - start)
+                             .count();
+  payload.clear();
+  payload_writer(payload).put(seconds);
+  if (complete)
+    send_message(fd, job_done, payload.data(), payload.size());
+  if (log)
+    std::cerr << job.scene << " " << job.width << "x" << job.height << " "
+              << job.samples_per_pixel << " spp: scene "
+              << (hit ? "cached" : "built") << ", tracing after "
+              << setup * 1e3 << " ms, "
+              << (complete ? "done in " : "cancelled after ") << seconds
+              << " s; cache " << cache.size() << " scenes, "
+              << cache.bytes() / (1 << 20) << " MiB\n";
+}
+
+// Client side: sends job to the server at address and collects the tiles
+// into fb. on_tile(tile) is called as each arrives. Returns false, with a
+// message on std::cerr, if the server could not be reached or refused.
+template <typename Callback>
+inline bool request_render(const socket_address &address,
+                           const render_job &job, framebuffer &fb,
+                           Callback on_tile) {
+  auto fd = connect_to(address);
+  if (!fd) {
+    std::cerr << "ERROR: Could not connect to the render server.\n";
+    return false;
+  }
+  std::vector<char> payload;
+  payload_writer out(payload);
+  job.write(out);
+  if (!send_message(fd.get(), job_request, payload.data(), payload.size()))
+    return false;
+
+  fb = framebuffer(job.width, job.height);
+  const size_t max_tile_bytes =
+      sizeof(tile) + tile_bytes(std::min(job.tile_size, job.width),
+                                std::min(job.tile_size, job.height));
+  auto limit = [&](uint32_t type) {
+    return type == job_tile ? max_tile_bytes : max_reply_bytes;
+  };
+  for (;;) {
+    uint32_t type = 0;
+    if (!receive_message(fd.get(), type, payload, limit)) {
+      std::cerr << "ERROR: Lost the connection to the render server.\n";
+      return false;
+    }
+    payload_reader in(payload);
+    if (type == job_error) {
+      std::string message;
+      in.get(message);
+      std::cerr << "ERROR: Render server: " << message << ".\n";
+      return false;
+    }
+    if (type == job_done)
+      return true;
+    if (type == job_tile) {
+      tile t;
+      if (!in.get(t) || !get_tile(in, fb, t)) {
+        std::cerr << "ERROR: Bad tile from the render server.\n";
+        return false;
+      }
+      on_tile(t);
+    }
+  }
+}
+
+} // namespace raytracer
+
+#endif // RENDER_SERVER_H_
@@ -0,0 +1,143 @@
+#ifndef RENDERER_H_
+#define RENDERER_H_
+
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "numa.hpp"
+#include "render.hpp"
+#include "render_async.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "thread_pool.hpp"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace raytracer {
+
+// Renders successive frames or jobs on one persistent thread pool. The
+// free render functions start an OpenMP team for every pass; a Renderer
+// keeps its workers, and with them their RNG slots, between passes and
+// frames, which matters when frames are small and many.
+//
+// On NUMA machines the workers can be pinned to nodes (numa_mode::pin), so
+// that tiles are scheduled per node, and in addition render from a copy of
+// the scene made on their own node (numa_mode::replicate), so that BVH and
+// texture reads stay in local memory. Copies are made when a scene is first
+// rendered and reused while the same scene, with the same build, is
+// rendered again.
+class Renderer {
+public:
+  // threads = 0 uses one thread per hardware thread. The topology defaults
+  // to the machine's.
+  explicit Renderer(int threads = 0, numa_mode _numa = numa_mode::off,
+                    numa_topology _topology = numa_topology::detect())
+      : numa(_numa), topology(std::move(_topology)),
+        workers(threads, numa == numa_mode::off ? nullptr : &topology) {}
+
+  int threads() const { return workers.size(); }
+
+  // Whether renders read per node copies of the scene.
+  bool replicates() const {
+    return numa == numa_mode::replicate && workers.nodes() >= 2;
+  }
+
+  framebuffer render(const Scene &scene, const Camera &cam,
+                     const Sampler &sampler, render_settings settings) {
+    settings.pool = &workers;
+    settings.scene_replicas = replicas(scene);
+    return raytracer::render(scene, cam, sampler, settings);
+  }
+
+  std::vector<framebuffer> render_views(const Scene &scene,
+                                        const std::vector<Camera> &cams,
+                                        const Sampler &sampler,
+                                        render_settings settings) {
+    settings.pool = &workers;
+    settings.scene_replicas = replicas(scene);
+    return raytracer::render_views(scene, cams, sampler, settings);
+  }
+
+  template <typename Callback>
+  void render_progressive(const Scene &scene, const Camera &cam,
+                          const Sampler &sampler, render_settings settings,
+                          framebuffer &fb, Callback after_pass) {
+    settings.pool = &workers;
+    settings.scene_replicas = replicas(scene);
+    raytracer::render_progressive(scene, cam, sampler, settings, fb,
+                                  after_pass);
+  }
+
+  template <typename Callback>
+  void render_timed(const Scene &scene, const Camera &cam,
+                    const Sampler &sampler, render_settings settings,
+                    framebuffer &fb, double seconds, Callback after_pass) {
+    settings.pool = &workers;
+    settings.scene_replicas = replicas(scene);
+    raytracer::render_timed(scene, cam, sampler, settings, fb, seconds,
+                            after_pass);
+  }
+
+  template <typename Callback>
+  bool render_tiles(const Scene &scene, const Camera &cam,
+                    const Sampler &sampler, render_settings settings,
+                    framebuffer &fb, uint32_t until, Callback on_tile) {
+    settings.pool = &workers;
+    settings.scene_replicas = replicas(scene);
+    return raytracer::render_tiles(scene, cam, sampler, settings, fb, until,
+                                   on_tile);
+  }
+
+  // Starts a render in the background on the workers. The Renderer must
+  // outlive it. Renders started meanwhile wait until it has ended.
+  std::unique_ptr<render_handle>
+  render_async(frozen_scene scene, const Camera &cam,
+               std::shared_ptr<const Sampler> sampler,
+               render_settings settings) {
+    settings.pool = &workers;
+    settings.scene_replicas = replicas(*scene);
+    return raytracer::render_async(std::move(scene), cam, std::move(sampler),
+                                   settings);
+  }
+
+  thread_pool &pool() { return workers; }
+
+  // NUMA nodes the workers are spread over, 1 unless pinned.
+  int nodes() const { return workers.nodes(); }
+
+private:
+  numa_mode numa;
+  numa_topology topology;
+  thread_pool workers;
+  // Per node copies of the scene last rendered, and what they were made
+  // from. Renders hold their own reference, so replacing the copies does not
+  // change the scene of a render still running in the background.
+  std::shared_ptr<const std::vector<Scene>> copies;
+  const Scene *copied_scene = nullptr;
+  shared_ptr<hittable> copied_world; // held, so its address is not reused
+
+  std::shared_ptr<const std::vector<Scene>> replicas(const Scene &scene) {
+    if (!replicates())
+      return nullptr;
+    if (&scene == copied_scene && scene.world == copied_world)
+      return copies;
+
+    // The first thread of every node copies the scene, so the copy is
+    // allocated in that node's memory.
+    auto made = std::make_shared<std::vector<Scene>>(workers.nodes());
+    workers.run([&](int thread) {
+      auto node = workers.node(thread);
+      if (thread == 0 || workers.node(thread - 1) != node)
+        (*made)[node] = scene.replicate();
+    });
+    copies = std::move(made);
+    copied_scene = &scene;
+    copied_world = scene.world;
+    return copies;
+  }
+};
+
+} // namespace raytracer
+
+#endif // RENDERER_H_
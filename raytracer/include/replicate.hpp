@@ -0,0 +1,36 @@
+#ifndef REPLICATE_H_
+#define REPLICATE_H_
+
+#include "rtweekend.hpp"
+
+#include <unordered_map>
+
+namespace raytracer {
+
+// Originals and their copies while a scene is replicated, so that an object
+// shared in the original (a material used by many spheres, say) is copied
+// once and shared in the copy as well.
+class replica_map {
+public:
+  // Copy of original made by its replicate(), or original itself for types
+  // that do not copy themselves.
+  template <typename T> shared_ptr<T> get(const shared_ptr<T> &original) {
+    if (!original)
+      return original;
+    auto it = copies.find(original.get());
+    if (it != copies.end())
+      return std::static_pointer_cast<T>(it->second);
+    shared_ptr<T> copy = original->replicate(*this);
+    if (!copy)
+      copy = original;
+    copies.emplace(original.get(), copy);
+    return copy;
+  }
+
+private:
+  std::unordered_map<const void *, shared_ptr<void>> copies;
+};
+
+} // namespace raytracer
+
+#endif // REPLICATE_H_
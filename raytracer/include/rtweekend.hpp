@@ -4,7 +4,8 @@
 #include <cmath>
 #include <limits>
 #include <memory>
-#include <random>
+
+#include "sampler.hpp"
 
 // Usings
 
@@ -24,24 +25,18 @@ inline double degrees_to_radians(double degrees) {
 }
 
 template <typename T> inline T random_draw() {
-  // Returns a random real in [0,1).
-  static std::uniform_real_distribution<T> dist(0.0, 1.0);
-  static std::mt19937 gen;
-  return dist(gen);
+  // Returns a random real in [0,1) from the calling thread's generator.
+  return raytracer::thread_uniform<T>();
 }
 
 template <typename T> inline T random_draw(T min, T max) {
   // Returns a random real in [min,max).
-  static std::uniform_real_distribution<T> dist(min, max);
-  static std::mt19937 gen;
-  return dist(gen);
+  return min + (max - min) * random_draw<T>();
 }
 
 template <> inline int random_draw(int min, int max) {
-  // Returns a random real in [0,1).
-  static std::uniform_int_distribution<int> dist(0.0, 1.0);
-  static std::mt19937 gen;
-  return dist(gen);
+  // Returns a random integer in [min,max).
+  return raytracer::thread_uniform_int(min, max);
 }
 
 inline double clamp(double x, double min, double max) {
@@ -0,0 +1,437 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include "random.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace raytracer {
+
+// Every camera sample is a point in a high dimensional unit cube and every
+// dimension has one fixed purpose, so that a sampler can stratify the pixel
+// footprint, the lens and the shutter independently. Path vertex b owns the
+// dimensions [dim_bounce + b * dims_per_bounce, ... + dims_per_bounce),
+// in groups of bounce_group_dims.
+enum sample_dimension : uint32_t {
+  dim_pixel_x = 0,
+  dim_pixel_y,
+  dim_lens_u,
+  dim_lens_v,
+  dim_time,
+  dim_bounce
+};
+constexpr uint32_t dims_per_bounce = 8;
+// Width of the stratified groups within one bounce.
+constexpr uint32_t bounce_group_dims = 4;
+static_assert(dims_per_bounce % bounce_group_dims == 0,
+              "bounce groups must not straddle bounces");
+
+// Purposes of the dimensions of one path vertex. Sequential draws made while
+// scattering take the first three.
+enum bounce_dimension : uint32_t {
+  bounce_dim_scatter = 0,
+  bounce_dim_roulette = 3,
+  bounce_dim_light_u = bounce_group_dims,
+  bounce_dim_light_v
+};
+
+// First dimension of the group `dim` belongs to. Samplers decorrelate
+// groups from each other but keep the dimensions within one stratified.
+inline uint32_t dimension_group(uint32_t dim) {
+  if (dim < dim_lens_u)
+    return dim_pixel_x;
+  if (dim < dim_time)
+    return dim_lens_u;
+  if (dim < dim_bounce)
+    return dim_time;
+  return dim - (dim - dim_bounce) % bounce_group_dims;
+}
+
+namespace detail {
+
+inline std::atomic<uint64_t> &rng_global_seed() {
+  static std::atomic<uint64_t> seed{5489};
+  return seed;
+}
+
+inline std::atomic<uint64_t> &rng_stream_counter() {
+  static std::atomic<uint64_t> counter{0};
+  return counter;
+}
+
+} // namespace detail
+
+// Seed used by generators of threads that have not drawn yet and by samplers
+// created afterwards. Threads that already own a generator keep theirs;
+// reseed those with thread_rng().seed().
+inline void set_rng_seed(uint64_t seed) {
+  detail::rng_global_seed() = seed;
+  detail::rng_stream_counter() = 0;
+}
+
+inline uint64_t rng_seed() { return detail::rng_global_seed().load(); }
+
+// Source of sample values. Values are a pure function of the pixel, the
+// sample index and the dimension, so renders are reproducible no matter how
+// the work is split between threads.
+class Sampler {
+public:
+  Sampler(uint64_t _seed)
+      : seed(_seed), key{static_cast<uint32_t>(_seed),
+                         static_cast<uint32_t>(_seed >> 32)} {}
+  virtual ~Sampler() = default;
+
+  // Value in [0,1) of dimension `dim` of sample `index` in pixel (x, y).
+  virtual double get(uint32_t x, uint32_t y, uint32_t index,
+                     uint32_t dim) const = 0;
+
+  // Independent uniform value, used for dimensions a sampler does not cover.
+  // Different streams never share values.
+  double independent(uint32_t x, uint32_t y, uint32_t index, uint32_t dim,
+                     uint32_t stream = 0) const {
+    auto r = philox4x32({x, y, index, dim}, {key[0], key[1] ^ stream});
+    return static_cast<double>(((uint64_t{r[0]} << 32) | r[1]) >> 11) *
+           0x1.0p-53;
+  }
+
+protected:
+  uint64_t seed;
+  std::array<uint32_t, 2> key;
+
+  uint32_t seed32() const {
+    return static_cast<uint32_t>(seed) ^ static_cast<uint32_t>(seed >> 32);
+  }
+};
+
+// Uniform random values from Philox, the behaviour of plain random_draw.
+class IndependentSampler : public Sampler {
+public:
+  IndependentSampler(uint64_t seed = rng_seed()) : Sampler(seed) {}
+
+  virtual double get(uint32_t x, uint32_t y, uint32_t index,
+                     uint32_t dim) const override {
+    return independent(x, y, index, dim);
+  }
+};
+
+// Halton sequence with the prime bases in dimension order and a per pixel
+// Cranley-Patterson rotation. Dimensions past the prime table are
+// independent.
+class HaltonSampler : public Sampler {
+public:
+  HaltonSampler(uint64_t seed = rng_seed()) : Sampler(seed) {}
+
+  virtual double get(uint32_t x, uint32_t y, uint32_t index,
+                     uint32_t dim) const override {
+    static constexpr uint32_t primes[] = {
+        2,  3,  5,  7,  11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+    if (dim >= std::size(primes))
+      return independent(x, y, index, dim);
+
+    auto value = radical_inverse(primes[dim], index) +
+                 hash32(x, y, hash32(dim, seed32())) * 0x1.0p-32;
+    return value < 1 ? value : value - 1;
+  }
+
+private:
+  static double radical_inverse(uint32_t base, uint32_t index) {
+    const double inv_base = 1.0 / base;
+    double inv = inv_base;
+    double value = 0;
+    while (index > 0) {
+      value += (index % base) * inv;
+      index /= base;
+      inv *= inv_base;
+    }
+    return value;
+  }
+};
+
+// Sobol (0,2)-sequence in up to four dimensions per group, with the index
+// shuffled and the values Owen scrambled through the hash based nested
+// uniform scramble of Burley, "Practical Hash-based Owen Scrambling", 2020.
+class SobolSampler : public Sampler {
+public:
+  SobolSampler(uint64_t seed = rng_seed()) : Sampler(seed) {}
+
+  virtual double get(uint32_t x, uint32_t y, uint32_t index,
+                     uint32_t dim) const override {
+    auto group = dimension_group(dim);
+    return scrambled(index, dim - group, hash32(x, y, hash32(group, seed32()))) *
+           0x1.0p-32;
+  }
+
+protected:
+  // Generator matrices of the first four Sobol dimensions, built from the
+  // primitive polynomials and initial numbers of Joe and Kuo.
+  static const std::array<std::array<uint32_t, 32>, 4> &matrices() {
+    static const auto m = [] {
+      std::array<std::array<uint32_t, 32>, 4> v{};
+      struct poly {
+        uint32_t s, a;
+        uint32_t m[3];
+      };
+      const poly polys[3] = {{1, 0, {1}}, {2, 1, {1, 3}}, {3, 1, {1, 3, 1}}};
+      for (uint32_t k = 0; k < 32; ++k)
+        v[0][k] = 1U << (31 - k);
+      for (int d = 1; d < 4; ++d) {
+        const auto &p = polys[d - 1];
+        for (uint32_t k = 0; k < 32; ++k) {
+          if (k < p.s) {
+            v[d][k] = p.m[k] << (31 - k);
+            continue;
+          }
+          v[d][k] = v[d][k - p.s] ^ (v[d][k - p.s] >> p.s);
+          for (uint32_t l = 1; l < p.s; ++l)
+            if ((p.a >> (p.s - 1 - l)) & 1)
+              v[d][k] ^= v[d][k - l];
+        }
+      }
+      return v;
+    }();
+    return m;
+  }
+
+  static uint32_t sobol(uint32_t index, uint32_t d) {
+    const auto &v = matrices()[d];
+    uint32_t result = 0;
+    for (int k = 0; index; index >>= 1, ++k)
+      if (index & 1)
+        result ^= v[k];
+    return result;
+  }
+
+  static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cU;
+    x ^= x * 0xb82f1e52U;
+    x ^= x * 0xc7afe638U;
+    x ^= x * 0x8d22f6e6U;
+    return x;
+  }
+
+  static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+  }
+
+  // Component k of the shuffled and scrambled point `index` of a group
+  // seeded with `group_seed`.
+  static uint32_t scrambled(uint32_t index, uint32_t k, uint32_t group_seed) {
+    auto i = nested_uniform_scramble(index, group_seed);
+    return nested_uniform_scramble(sobol(i, k), hash32(group_seed, k + 1));
+  }
+};
+
+// Side length of the tiled blue noise mask.
+constexpr int blue_noise_size = 64;
+
+// Blue noise ranks of a blue_noise_size^2 tile, scaled to the full 32 bit
+// range. Built once by void filling: every next rank goes to the free texel
+// with the lowest energy under a toroidal Gaussian around the texels taken.
+inline const std::vector<uint32_t> &blue_noise_mask() {
+  static const std::vector<uint32_t> mask = [] {
+    constexpr int n = blue_noise_size;
+    constexpr double sigma = 1.9;
+    std::vector<double> kernel(n * n);
+    for (int dy = 0; dy < n; ++dy)
+      for (int dx = 0; dx < n; ++dx) {
+        double wx = std::min(dx, n - dx), wy = std::min(dy, n - dy);
+        kernel[dy * n + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+      }
+
+    // A tiny hashed bias breaks ties between texels of equal energy.
+    std::vector<double> energy(n * n);
+    for (int i = 0; i < n * n; ++i)
+      energy[i] = hash32(i) * 0x1.0p-32 * 1e-9;
+
+    std::vector<uint32_t> ranks(n * n);
+    std::vector<bool> taken(n * n, false);
+    for (int rank = 0; rank < n * n; ++rank) {
+      int best = -1;
+      for (int i = 0; i < n * n; ++i)
+        if (!taken[i] && (best < 0 || energy[i] < energy[best]))
+          best = i;
+      taken[best] = true;
+      ranks[best] = static_cast<uint32_t>(
+          (static_cast<uint64_t>(rank) << 32) / (n * n));
+      const int bx = best % n, by = best / n;
+      for (int y = 0; y < n; ++y)
+        for (int x = 0; x < n; ++x)
+          energy[y * n + x] +=
+              kernel[((y - by + n) % n) * n + (x - bx + n) % n];
+    }
+    return ranks;
+  }();
+  return mask;
+}
+
+// Scrambled Sobol points that are the same in every pixel, shifted per pixel
+// by a blue noise mask (Georgiev and Fajardo 2016). The error of
+// neighbouring pixels is then anti-correlated, so the remaining noise sits
+// at high frequencies where it is least visible.
+class BlueNoiseSampler : public SobolSampler {
+public:
+  BlueNoiseSampler(uint64_t seed = rng_seed()) : SobolSampler(seed) {}
+
+  virtual double get(uint32_t x, uint32_t y, uint32_t index,
+                     uint32_t dim) const override {
+    constexpr uint32_t n = blue_noise_size;
+    auto group = dimension_group(dim);
+    auto value = scrambled(index, dim - group, hash32(group, seed32()));
+    // Every dimension reads the mask at its own offset.
+    auto offset = hash32(dim, seed32());
+    auto mx = (x + offset) % n, my = (y + (offset >> 16)) % n;
+    return static_cast<uint32_t>(value + blue_noise_mask()[my * n + mx]) *
+           0x1.0p-32;
+  }
+};
+
+// Sampler by name: independent, halton, sobol or bluenoise. Returns nullptr
+// for unknown names.
+inline std::shared_ptr<Sampler> make_sampler(const std::string &name,
+                                        uint64_t seed = rng_seed()) {
+  if (name == "independent")
+    return std::make_shared<IndependentSampler>(seed);
+  if (name == "halton")
+    return std::make_shared<HaltonSampler>(seed);
+  if (name == "sobol")
+    return std::make_shared<SobolSampler>(seed);
+  if (name == "bluenoise")
+    return std::make_shared<BlueNoiseSampler>(seed);
+  return nullptr;
+}
+
+// Draws of one camera sample. Sequential draws at a path vertex take the
+// vertex's sampler dimensions first and independent values after that, so
+// rejection loops stay unbiased.
+class sample_stream {
+public:
+  void begin(const Sampler &_sampler, uint32_t _x, uint32_t _y,
+             uint32_t _index) {
+    sampler = &_sampler;
+    x = _x;
+    y = _y;
+    index = _index;
+    bounce = 0;
+    draw = 0;
+  }
+
+  void next_bounce() {
+    ++bounce;
+    draw = 0;
+  }
+
+  double get(uint32_t dim) const { return sampler->get(x, y, index, dim); }
+
+  // Dimension k of the current path vertex.
+  double get_bounce(uint32_t k) const {
+    return get(dim_bounce + bounce * dims_per_bounce + k);
+  }
+
+  double next() {
+    auto k = draw++;
+    if (k < bounce_dim_roulette)
+      return get_bounce(bounce_dim_scatter + k);
+    return sampler->independent(x, y, index, (bounce << 16) | k, 1);
+  }
+
+  template <typename T> T uniform() {
+    if constexpr (sizeof(T) == sizeof(float))
+      return static_cast<T>(static_cast<uint32_t>(next() * 0x1.0p24)) *
+             T(0x1.0p-24);
+    else
+      return static_cast<T>(next());
+  }
+
+  int uniform_int(int min, int max) {
+    return min + static_cast<int>(next() * (static_cast<double>(max) - min));
+  }
+
+private:
+  const Sampler *sampler = nullptr;
+  uint32_t x = 0, y = 0, index = 0, bounce = 0, draw = 0;
+};
+
+namespace detail {
+
+// Per thread random state, padded to its own cache line so that threads
+// drawing in a tight loop never share a line. Draws come from the bound
+// sample stream while a camera sample is traced and from gen otherwise.
+struct alignas(64) thread_rng_slot {
+  xoshiro256plus gen;
+  sample_stream stream;
+  bool bound = false;
+
+  thread_rng_slot() : gen(0) {
+    gen.seed(rng_global_seed().load(), rng_stream_counter().fetch_add(1));
+  }
+};
+
+inline thread_rng_slot &thread_slot() {
+  thread_local thread_rng_slot slot;
+  return slot;
+}
+
+} // namespace detail
+
+// The calling thread's sequential generator.
+inline xoshiro256plus &thread_rng() { return detail::thread_slot().gen; }
+
+// Uniform draw for the calling thread, from the bound sample stream if any.
+template <typename T> inline T thread_uniform() {
+  auto &slot = detail::thread_slot();
+  return slot.bound ? slot.stream.uniform<T>() : slot.gen.uniform<T>();
+}
+
+inline int thread_uniform_int(int min, int max) {
+  auto &slot = detail::thread_slot();
+  return slot.bound ? slot.stream.uniform_int(min, max)
+                    : slot.gen.uniform_int(min, max);
+}
+
+// Binds the calling thread's draws to sample `index` of pixel (x, y) for the
+// lifetime of the scope.
+class sample_scope {
+public:
+  sample_scope(const Sampler &sampler, uint32_t x, uint32_t y,
+               uint32_t index) {
+    auto &slot = detail::thread_slot();
+    slot.stream.begin(sampler, x, y, index);
+    slot.bound = true;
+  }
+  ~sample_scope() { detail::thread_slot().bound = false; }
+
+  sample_scope(const sample_scope &) = delete;
+  sample_scope &operator=(const sample_scope &) = delete;
+};
+
+// Value of a fixed purpose dimension of the bound camera sample.
+inline double sample_value(uint32_t dim) {
+  auto &slot = detail::thread_slot();
+  return slot.bound ? slot.stream.get(dim) : slot.gen.uniform<double>();
+}
+
+// Value of a fixed purpose dimension of the current path vertex.
+inline double sample_bounce_value(uint32_t k) {
+  auto &slot = detail::thread_slot();
+  return slot.bound ? slot.stream.get_bounce(k) : slot.gen.uniform<double>();
+}
+
+// Moves the bound sample stream on to the next path vertex.
+inline void sample_next_bounce() {
+  auto &slot = detail::thread_slot();
+  if (slot.bound)
+    slot.stream.next_bounce();
+}
+
+} // namespace raytracer
+
+#endif // SAMPLER_H_
@@ -0,0 +1,103 @@
+#ifndef SCENE_H_
+#define SCENE_H_
+
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "motion_bvh.hpp"
+#include "replicate.hpp"
+#include "rtweekend.hpp"
+
+#include <unordered_map>
+#include <utility>
+
+namespace raytracer {
+
+// Radiance of rays that leave the scene: the sky gradient or a constant.
+struct environment {
+  bool sky = true;
+  Color color{0, 0, 0};
+
+  Color value(const Ray &r) const {
+    if (!sky)
+      return color;
+    Vector unit_direction = unit_vector(r.direction());
+    auto t = 0.5 * (unit_direction.y() + 1.0);
+    return (1.0 - t) * Color(1.0, 1.0, 1.0) + t * Color(0.5, 0.7, 1.0);
+  }
+};
+
+// Everything a render needs besides the camera.
+struct Scene {
+  hittable_list objects;
+  // Emitters that are sampled explicitly. They must also be in objects.
+  hittable_list lights;
+  environment background;
+  // Acceleration structure over objects, made by build().
+  shared_ptr<hittable> world;
+
+  Scene() {}
+  Scene(hittable_list _objects) : objects(_objects) {}
+
+  void build(double _time0, double _time1) {
+    set_world(make_shared<motion_bvh>(objects, _time0, _time1), _time0,
+              _time1);
+  }
+
+  // Renders from world, an acceleration structure over objects valid for
+  // [time0, time1] made elsewhere, such as one refit for an animation frame.
+  void set_world(shared_ptr<hittable> _world, double _time0, double _time1) {
+    world = std::move(_world);
+    time0 = _time0;
+    time1 = _time1;
+    // Objects are not changed once built, so later worlds keep the IDs.
+    if (object_ids.size() == objects.objects.size())
+      return;
+    object_ids.clear();
+    for (size_t k = 0; k < objects.objects.size(); ++k)
+      object_ids.emplace(objects.objects[k].get(), static_cast<int>(k));
+  }
+
+  // Nothing below changes a built scene, and rendering only uses these
+  // const members, so a built scene may be read by any number of threads
+  // and renders at once.
+
+  // Index in objects of a primitive returned in hit_record::object, or -1.
+  int object_id(const hittable *object) const {
+    auto it = object_ids.find(object);
+    return it == object_ids.end() ? -1 : it->second;
+  }
+
+  // Copy of the scene whose objects, materials, textures and BVH are
+  // allocated by the calling thread, so that a thread pinned to a NUMA node
+  // makes a copy in that node's memory. Objects are copied through their
+  // replicate(); those that do not implement it are shared. The copy has the
+  // same objects in the same order and renders the same image.
+  Scene replicate() const {
+    replica_map map;
+    Scene copy;
+    for (const auto &object : objects.objects)
+      copy.objects.add(map.get(object));
+    for (const auto &light : lights.objects)
+      copy.lights.add(map.get(light));
+    copy.background = background;
+    if (world)
+      copy.build(time0, time1);
+    return copy;
+  }
+
+private:
+  std::unordered_map<const hittable *, int> object_ids;
+  double time0 = 0, time1 = 0; // of the last build()
+};
+
+// A built scene that can no longer be changed, for sharing between
+// concurrent renders, views and jobs.
+using frozen_scene = shared_ptr<const Scene>;
+
+inline frozen_scene freeze(Scene scene) {
+  return make_shared<const Scene>(std::move(scene));
+}
+
+} // namespace raytracer
+
+#endif // SCENE_H_
@@ -0,0 +1,149 @@
+#ifndef SCENES_H_
+#define SCENES_H_
+
+#include "color.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include "rtweekend.hpp"
+#include "scene.hpp"
+#include "sphere.hpp"
+
+#include <string>
+
+namespace raytracer {
+
+inline Scene random_scene() {
+  hittable_list world;
+
+  auto checker =
+      make_shared<checker_texture>(Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+  world.add(make_shared<sphere>(Point(0, -1000, 0), 1000,
+                                make_shared<lambertian>(checker)));
+
+  for (int a = -11; a < 11; a++) {
+    for (int b = -11; b < 11; b++) {
+      auto choose_mat = random_draw<double>();
+      Point center(a + 0.9 * random_draw<double>(), 0.2,
+                   b + 0.9 * random_draw<double>());
+
+      if ((center - Point(4, 0.2, 0)).length() > 0.9) {
+        shared_ptr<material> sphere_material;
+
+        if (choose_mat < 0.8) {
+          // diffuse
+          auto albedo = mult_col(Color::random(), Color::random());
+          sphere_material = make_shared<lambertian>(albedo);
+          auto center2 = center + Vector(0, random_draw<double>(0, .5), 0);
+          world.add(make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2,
+                                               sphere_material));
+        } else if (choose_mat < 0.95) {
+          // metal
+          auto albedo = Color::random(0.5, 1);
+          auto fuzz = random_draw<double>(0, 0.5);
+          sphere_material = make_shared<metal>(albedo, fuzz);
+          world.add(make_shared<sphere>(center, 0.2, sphere_material));
+        } else {
+          // glass
+          sphere_material = make_shared<dielectric>(1.5);
+          world.add(make_shared<sphere>(center, 0.2, sphere_material));
+        }
+      }
+    }
+  }
+
+  auto material1 = make_shared<dielectric>(1.5);
+  world.add(make_shared<sphere>(Point(0, 1, 0), 1.0, material1));
+
+  auto material2 = make_shared<lambertian>(Color(0.4, 0.2, 0.1));
+  world.add(make_shared<sphere>(Point(-4, 1, 0), 1.0, material2));
+
+  auto material3 = make_shared<metal>(Color(0.7, 0.6, 0.5), 0.0);
+  world.add(make_shared<sphere>(Point(4, 1, 0), 1.0, material3));
+
+  return Scene(world);
+}
+
+inline Scene two_spheres() {
+  hittable_list objects;
+
+  auto checker =
+      make_shared<checker_texture>(Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+
+  objects.add(make_shared<sphere>(Point(0, -10, 0), 10,
+                                  make_shared<lambertian>(checker)));
+
+  auto pertext = make_shared<noise_texture>();
+  objects.add(make_shared<sphere>(Point(0, 10, 0), 10,
+                                  make_shared<lambertian>(pertext)));
+
+  auto sphere_material = make_shared<dielectric>(1.5);
+  objects.add(make_shared<sphere>(Point(3, 0, 3), 1, sphere_material));
+  // metal
+  // auto albedo = Color::random(0.5, 1);
+  // auto fuzz = random_draw<double>(0, 0.5);
+  // auto sphere_material_m = make_shared<metal>(albedo, fuzz);
+  // objects.add(make_shared<sphere>(Point(3, 0, -3), 1, sphere_material_m));
+
+  return Scene(objects);
+}
+
+inline Scene two_perlin_spheres() {
+  hittable_list objects;
+
+  auto pertext = make_shared<noise_texture>(4);
+  objects.add(make_shared<sphere>(Point(0, -1000, 0), 1000,
+                                  make_shared<lambertian>(pertext)));
+  objects.add(
+      make_shared<sphere>(Point(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+
+  return Scene(objects);
+}
+
+inline Scene earth() {
+  auto earth_texture = make_shared<image_texture>("../../data/earth.jpg");
+  auto earth_surface = make_shared<lambertian>(earth_texture);
+  auto globe = make_shared<sphere>(Point(0, 0, 0), 2, earth_surface);
+
+  return Scene(hittable_list(globe));
+}
+
+// Lit only by a small spherical lamp, so almost all light reaches the
+// camera through a single diffuse bounce off the lit surfaces.
+inline Scene simple_light() {
+  Scene scene;
+
+  auto pertext = make_shared<noise_texture>(4);
+  scene.objects.add(make_shared<sphere>(Point(0, -1000, 0), 1000,
+                                        make_shared<lambertian>(pertext)));
+  scene.objects.add(
+      make_shared<sphere>(Point(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+
+  auto lamp = make_shared<sphere>(Point(0, 7, 0), 0.5,
+                                  make_shared<diffuse_light>(Color(40, 40, 40)));
+  scene.objects.add(lamp);
+  scene.lights.add(lamp);
+
+  scene.background.sky = false;
+  return scene;
+}
+
+// Scene of the given name, unbuilt. Returns false for an unknown name.
+inline bool make_scene(const std::string &name, Scene &scene) {
+  if (name == "random")
+    scene = random_scene();
+  else if (name == "two_spheres")
+    scene = two_spheres();
+  else if (name == "two_perlin_spheres")
+    scene = two_perlin_spheres();
+  else if (name == "earth")
+    scene = earth();
+  else if (name == "simple_light")
+    scene = simple_light();
+  else
+    return false;
+  return true;
+}
+
+} // namespace raytracer
+
+#endif // SCENES_H_
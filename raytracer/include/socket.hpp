@@ -0,0 +1,330 @@
+#ifndef SOCKET_H_
+#define SOCKET_H_
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace raytracer {
+
+// Stream socket endpoint, written "unix:/path" for a Unix domain socket or
+// "host:port" (optionally "tcp:host:port") for TCP.
+struct socket_address {
+  bool unix_domain = false;
+  std::string path; // Unix socket
+  std::string host; // TCP, empty to listen on all interfaces
+  std::string port;
+
+  static bool parse(const std::string &text, socket_address &address) {
+    address = socket_address();
+    if (text.rfind("unix:", 0) == 0) {
+      address.unix_domain = true;
+      address.path = text.substr(5);
+      return !address.path.empty() &&
+             address.path.size() < sizeof(sockaddr_un::sun_path);
+    }
+    auto rest = text.rfind("tcp:", 0) == 0 ? text.substr(4) : text;
+    auto colon = rest.rfind(':');
+    if (colon == std::string::npos || colon + 1 == rest.size())
+      return false;
+    address.host = rest.substr(0, colon);
+    address.port = rest.substr(colon + 1);
+    return true;
+  }
+};
+
+// Owns a file descriptor and closes it.
+class socket_fd {
+public:
+  socket_fd() {}
+  explicit socket_fd(int _fd) : fd(_fd) {}
+  socket_fd(socket_fd &&other) : fd(other.release()) {}
+  socket_fd &operator=(socket_fd &&other) {
+    if (this != &other) {
+      close();
+      fd = other.release();
+    }
+    return *this;
+  }
+  ~socket_fd() { close(); }
+
+  int get() const { return fd; }
+  explicit operator bool() const { return fd >= 0; }
+
+  int release() {
+    int f = fd;
+    fd = -1;
+    return f;
+  }
+
+  void close() {
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+private:
+  int fd = -1;
+};
+
+namespace detail {
+
+// Calls fn(family, sockaddr, length) for the addresses of `address` until
+// it returns a valid socket.
+template <typename Fn>
+inline socket_fd for_each_address(const socket_address &address,
+                                  bool passive, Fn fn) {
+  if (address.unix_domain) {
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    std::strncpy(sa.sun_path, address.path.c_str(), sizeof(sa.sun_path) - 1);
+    return fn(AF_UNIX, reinterpret_cast<sockaddr *>(&sa), sizeof sa);
+  }
+  addrinfo hints{}, *list = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  if (getaddrinfo(address.host.empty() ? nullptr : address.host.c_str(),
+                  address.port.c_str(), &hints, &list) != 0)
+    return socket_fd();
+  socket_fd fd;
+  for (auto *ai = list; ai && !fd; ai = ai->ai_next)
+    fd = fn(ai->ai_family, ai->ai_addr, ai->ai_addrlen);
+  freeaddrinfo(list);
+  return fd;
+}
+
+} // namespace detail
+
+// Listening socket on address. A stale Unix socket file is replaced.
+inline socket_fd listen_on(const socket_address &address) {
+  if (address.unix_domain)
+    ::unlink(address.path.c_str());
+  auto fd = detail::for_each_address(
+      address, true, [](int family, sockaddr *sa, socklen_t length) {
+        socket_fd fd(::socket(family, SOCK_STREAM, 0));
+        int on = 1;
+        if (fd && family != AF_UNIX)
+          setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (fd && (::bind(fd.get(), sa, length) != 0 ||
+                   ::listen(fd.get(), 64) != 0))
+          fd.close();
+        return fd;
+      });
+  if (!fd)
+    std::cerr << "ERROR: Could not listen on "
+              << (address.unix_domain ? address.path
+                                      : address.host + ":" + address.port)
+              << ".\n";
+  return fd;
+}
+
+// Connects to address, retrying for up to `seconds` while nobody listens
+// yet.
+inline socket_fd connect_to(const socket_address &address,
+                            double seconds = 0) {
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::duration<double>(seconds));
+  for (;;) {
+    auto fd = detail::for_each_address(
+        address, false, [](int family, sockaddr *sa, socklen_t length) {
+          socket_fd fd(::socket(family, SOCK_STREAM, 0));
+          if (fd && ::connect(fd.get(), sa, length) != 0)
+            fd.close();
+          int on = 1;
+          if (fd && family != AF_UNIX)
+            setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+          return fd;
+        });
+    if (fd || std::chrono::steady_clock::now() >= deadline)
+      return fd;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+}
+
+// Makes sends and receives on fd fail once they have made no progress for
+// `seconds`, so that a peer that stops sending or reading cannot hold up
+// the other end for good.
+inline bool set_timeouts(int fd, double seconds) {
+  timeval tv{};
+  tv.tv_sec = static_cast<time_t>(seconds);
+  tv.tv_usec = static_cast<suseconds_t>((seconds - tv.tv_sec) * 1e6);
+  return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) == 0;
+}
+
+inline bool write_all(int fd, const void *data, size_t size) {
+  auto bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    auto n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool read_all(int fd, void *data, size_t size) {
+  auto bytes = static_cast<char *>(data);
+  while (size > 0) {
+    auto n = ::recv(fd, bytes, size, 0);
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Messages are a header followed by `size` bytes of payload. Values are
+// sent in host byte order, so both ends must share it.
+struct message_header {
+  uint32_t type = 0;
+  uint32_t size = 0;
+};
+
+inline bool send_message(int fd, uint32_t type, const void *payload,
+                         size_t size) {
+  message_header header{type, static_cast<uint32_t>(size)};
+  return write_all(fd, &header, sizeof header) &&
+         (size == 0 || write_all(fd, payload, size));
+}
+
+// Reads a message whose payload is at most max_size(type) bytes. A larger
+// one fails before anything is allocated for it, so a peer cannot make the
+// receiver allocate what it likes.
+template <typename Limit>
+inline bool receive_message(int fd, uint32_t &type, std::vector<char> &payload,
+                            Limit max_size) {
+  message_header header;
+  if (!read_all(fd, &header, sizeof header) ||
+      header.size > max_size(header.type))
+    return false;
+  type = header.type;
+  payload.resize(header.size);
+  return header.size == 0 || read_all(fd, payload.data(), header.size);
+}
+
+// A message received in pieces, for peers that are polled rather than
+// waited for: fill() takes only the bytes that have arrived, so a peer that
+// stops halfway through a message holds up nobody.
+class message_buffer {
+public:
+  // Reads what has arrived of the current message. Returns false if the
+  // peer closed the connection or failed, or announced a payload larger
+  // than max_size(type).
+  template <typename Limit> bool fill(int fd, Limit max_size) {
+    while (!complete()) {
+      const bool in_header = got < sizeof header;
+      auto *to = in_header ? reinterpret_cast<char *>(&header) + got
+                           : payload.data() + (got - sizeof header);
+      auto size = in_header ? sizeof header - got
+                            : sizeof header + header.size - got;
+      auto n = ::recv(fd, to, size, MSG_DONTWAIT);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+      if (n <= 0)
+        return false;
+      got += n;
+      if (in_header && got == sizeof header) {
+        if (header.size > max_size(header.type))
+          return false;
+        payload.resize(header.size);
+      }
+    }
+    return true;
+  }
+
+  // Whether a whole message has arrived.
+  bool complete() const {
+    return got >= sizeof header && got == sizeof header + header.size;
+  }
+
+  // Hands over a complete message and starts on the next.
+  void take(uint32_t &type, std::vector<char> &out) {
+    type = header.type;
+    out.swap(payload);
+    payload.clear();
+    got = 0;
+  }
+
+private:
+  message_header header;
+  std::vector<char> payload;
+  size_t got = 0; // bytes of header and payload so far
+};
+
+// Appends the bytes of trivially copyable values to a payload, and reads
+// them back in the same order.
+class payload_writer {
+public:
+  explicit payload_writer(std::vector<char> &_out) : out(_out) {}
+
+  template <typename T> payload_writer &put(const T &value) {
+    return put(&value, sizeof(T));
+  }
+
+  payload_writer &put(const void *data, size_t size) {
+    auto pos = out.size();
+    out.resize(pos + size);
+    if (size > 0)
+      std::memcpy(out.data() + pos, data, size);
+    return *this;
+  }
+
+  payload_writer &put(const std::string &s) {
+    put(static_cast<uint32_t>(s.size()));
+    return put(s.data(), s.size());
+  }
+
+private:
+  std::vector<char> &out;
+};
+
+class payload_reader {
+public:
+  explicit payload_reader(const std::vector<char> &_in) : in(_in) {}
+
+  template <typename T> bool get(T &value) { return get(&value, sizeof(T)); }
+
+  bool get(void *data, size_t size) {
+    if (in.size() - pos < size)
+      return false;
+    std::memcpy(data, in.data() + pos, size);
+    pos += size;
+    return true;
+  }
+
+  bool get(std::string &s) {
+    uint32_t size = 0;
+    if (!get(size) || in.size() - pos < size)
+      return false;
+    s.assign(in.data() + pos, size);
+    pos += size;
+    return true;
+  }
+
+private:
+  const std::vector<char> &in;
+  size_t pos = 0;
+};
+
+} // namespace raytracer
+
+#endif // SOCKET_H_
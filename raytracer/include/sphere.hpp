@@ -2,9 +2,22 @@
 #define _SPHERE
 
 #include "hittable.hpp"
+#include "onb.hpp"
+#include "replicate.hpp"
 #include "vec3.hpp"
 
 namespace raytracer {
+
+// Texture coordinates of a point on the unit sphere.
+inline std::pair<double, double>
+u_v_from_sphere_hit_point(const Point &hit_point) {
+  auto theta = acos(clamp(-hit_point.y(), -1.0, 1.0));
+  auto phi = atan2(-hit_point.z(), hit_point.x()) + pi;
+  auto u = phi / (2 * pi);
+  auto v = theta / pi;
+  return {u, v};
+}
+
 class sphere : public hittable {
 public:
   sphere() {}
@@ -17,19 +30,18 @@ public:
   virtual bool bounding_box(double time0, double time1,
                             aabb &output_box) const override;
 
+  virtual double pdf_value(const Point &o, const Vector &v) const override;
+
+  virtual Vector random(const Point &o, double u1, double u2) const override;
+
+  virtual shared_ptr<hittable> replicate(replica_map &map) const override {
+    return make_shared<sphere>(center, radius, map.get(mat_ptr));
+  }
+
 private:
   Point center;
   double radius;
   shared_ptr<material> mat_ptr;
-
-  inline std::pair<double, double>
-  u_v_from_sphere_hit_point(const Point &hit_point) const {
-    auto theta = acos(-hit_point.y());
-    auto phi = atan2(-hit_point.z(), hit_point.x()) + pi;
-    auto u = phi / (2 * pi);
-    auto v = theta / pi;
-    return {u, v};
-  }
 };
 
 inline bool sphere::hit(const Ray &r, double t_min, double t_max,
@@ -51,17 +63,16 @@ inline bool sphere::hit(const Ray &r, double t_min, double t_max,
     if (root < t_min || t_max < root)
       return false;
   }
-  // Calculate hit point on sphere
-  auto [u, v] = u_v_from_sphere_hit_point(rec.p - center);
-
   rec.t = root;
   rec.p = r.at(rec.t);
-  rec.n = (rec.p - center) / radius;
+  Vector outward_n = (rec.p - center) / radius;
+  // Texture coordinates from the hit point on the unit sphere
+  auto [u, v] = u_v_from_sphere_hit_point(outward_n);
   rec.u = u;
   rec.v = v;
-  Vector outward_n = (rec.p - center) / radius;
   rec.set_face_normal(r, outward_n);
   rec.mat_ptr = mat_ptr;
+  rec.object = this;
 
   return true;
 }
@@ -73,6 +84,38 @@ inline bool sphere::bounding_box(double time0, double time1,
   return true;
 }
 
+inline double sphere::pdf_value(const Point &o, const Vector &v) const {
+  hit_record rec;
+  if (!this->hit(Ray(o, v), 0.001, infinity, rec))
+    return 0;
+
+  auto distance_squared = (center - o).length_squared();
+  if (distance_squared <= radius * radius)
+    return 1 / (4 * pi); // o is inside, every direction hits
+
+  auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+  auto solid_angle = 2 * pi * (1 - cos_theta_max);
+  return 1 / solid_angle;
+}
+
+inline Vector sphere::random(const Point &o, double u1, double u2) const {
+  Vector direction = center - o;
+  auto distance_squared = direction.length_squared();
+  auto phi = 2 * pi * u1;
+
+  if (distance_squared <= radius * radius) {
+    auto z = 1 - 2 * u2;
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    return Vector(r * cos(phi), r * sin(phi), z);
+  }
+
+  // Uniform in the cone of directions that see the sphere.
+  auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+  auto z = 1 + u2 * (cos_theta_max - 1);
+  auto r = sqrt(fmax(0.0, 1 - z * z));
+  return onb(direction).local(r * cos(phi), r * sin(phi), z);
+}
+
 class moving_sphere : public hittable {
 public:
   moving_sphere() {}
@@ -87,6 +130,20 @@ public:
   virtual bool bounding_box(double _time0, double _time1,
                             aabb &output_box) const override;
 
+  virtual Vector displacement(double _time0,
+                              double _time1) const override {
+    return center(_time1) - center(_time0);
+  }
+
+  virtual bool animated() const override {
+    return !(center1 - center0).near_zero();
+  }
+
+  virtual shared_ptr<hittable> replicate(replica_map &map) const override {
+    return make_shared<moving_sphere>(center0, center1, time0, time1, radius,
+                                      map.get(mat_ptr));
+  }
+
   Point center(double time) const;
 
 public:
@@ -123,8 +180,12 @@ inline bool moving_sphere::hit(const Ray &r, double t_min, double t_max,
   rec.t = root;
   rec.p = r.at(rec.t);
   auto outward_normal = (rec.p - center(r.time())) / radius;
+  auto [u, v] = u_v_from_sphere_hit_point(outward_normal);
+  rec.u = u;
+  rec.v = v;
   rec.set_face_normal(r, outward_normal);
   rec.mat_ptr = mat_ptr;
+  rec.object = this;
 
   return true;
 }
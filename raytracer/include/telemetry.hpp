@@ -0,0 +1,201 @@
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace raytracer {
+
+// Rays traced and path vertices scattered by the calling thread, counted by
+// ray_color. Plain thread locals, so counting costs an increment.
+struct ray_counts {
+  uint64_t rays = 0;
+  uint64_t bounces = 0;
+};
+
+inline ray_counts &thread_ray_counts() {
+  thread_local ray_counts counts;
+  return counts;
+}
+
+// Counters of one render thread, on a cache line of their own. Only the
+// owning thread writes them, with plain relaxed load and store rather than
+// read-modify-write, so publishing takes no lock and no bus traffic beyond
+// the line the thread already owns; readers see values at most a row old.
+struct alignas(64) thread_counters {
+  std::atomic<uint64_t> pixels{0};
+  std::atomic<uint64_t> samples{0};
+  std::atomic<uint64_t> rays{0};
+  std::atomic<uint64_t> bounces{0};
+  std::atomic<uint64_t> busy_ns{0}; // time spent rendering
+
+  static void add(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+  }
+};
+
+// Totals over all threads at one point in time.
+struct telemetry_snapshot {
+  double seconds = 0; // since the telemetry was created
+  uint64_t pixels = 0;
+  uint64_t samples = 0;
+  uint64_t rays = 0;
+  uint64_t bounces = 0;
+  std::vector<double> busy; // seconds per thread
+};
+
+// One set of counters per render thread, indexed like the threads of
+// parallel_tiles. Set render_settings::telemetry to have a render publish
+// into it.
+class render_telemetry {
+public:
+  explicit render_telemetry(int threads)
+      : size(std::max(threads, 1)), slots(new thread_counters[size]),
+        start(std::chrono::steady_clock::now()) {}
+
+  int threads() const { return size; }
+
+  thread_counters &thread(int index) { return slots[index]; }
+
+  telemetry_snapshot snapshot() const {
+    telemetry_snapshot s;
+    s.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    for (int k = 0; k < size; ++k) {
+      const auto &c = slots[k];
+      s.pixels += c.pixels.load(std::memory_order_relaxed);
+      s.samples += c.samples.load(std::memory_order_relaxed);
+      s.rays += c.rays.load(std::memory_order_relaxed);
+      s.bounces += c.bounces.load(std::memory_order_relaxed);
+      s.busy.push_back(c.busy_ns.load(std::memory_order_relaxed) * 1e-9);
+    }
+    return s;
+  }
+
+private:
+  int size;
+  std::unique_ptr<thread_counters[]> slots;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Prints progress of a render to std::cerr from a thread of its own, every
+// `interval` seconds and once more when destroyed: percent complete,
+// throughput in million rays per second, time left and how busy the render
+// threads were. Progress is measured against total_samples if that is not
+// 0, otherwise against a time budget of `seconds` if given, otherwise only
+// the sample count is shown.
+class progress_reporter {
+public:
+  progress_reporter(const render_telemetry &_telemetry,
+                    uint64_t _total_samples, double _seconds = 0,
+                    double _interval = 0.5)
+      : telemetry(_telemetry), total_samples(_total_samples),
+        seconds(_seconds), interval(_interval), last(telemetry.snapshot()),
+        worker([this] { run(); }) {}
+
+  ~progress_reporter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+
+    // Whole render: overall throughput and utilization of every thread.
+    auto now = telemetry.snapshot();
+    telemetry_snapshot zero;
+    zero.busy.assign(now.busy.size(), 0);
+    report(zero, now);
+    std::string line = "\nThread utilization:";
+    char buf[16];
+    for (auto busy : now.busy) {
+      std::snprintf(buf, sizeof buf, " %.0f%%",
+                    now.seconds > 0 ? std::min(100 * busy / now.seconds, 100.0)
+                                    : 0.0);
+      line += buf;
+    }
+    std::cerr << line << std::flush;
+  }
+
+  progress_reporter(const progress_reporter &) = delete;
+  progress_reporter &operator=(const progress_reporter &) = delete;
+
+private:
+  const render_telemetry &telemetry;
+  uint64_t total_samples;
+  double seconds;
+  double interval;
+  telemetry_snapshot last;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread worker; // last, so it starts after the members it uses
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait_for(lock, std::chrono::duration<double>(interval),
+                    [this] { return stopping; });
+      if (stopping)
+        return;
+      auto now = telemetry.snapshot();
+      report(last, now);
+      last = std::move(now);
+    }
+  }
+
+  // One status line for the interval from a to b.
+  void report(const telemetry_snapshot &a, const telemetry_snapshot &b) {
+    const double dt = std::max(b.seconds - a.seconds, 1e-9);
+    double busy = 0;
+    for (size_t k = 0; k < b.busy.size(); ++k)
+      busy += b.busy[k] - a.busy[k];
+
+    char buf[160];
+    int n = 0;
+    double left = -1;
+    if (total_samples) {
+      n = std::snprintf(buf, sizeof buf, "\r%5.1f%%",
+                        100.0 * std::min(b.samples, total_samples) /
+                            total_samples);
+      if (b.samples > 0)
+        left = b.seconds * (total_samples - std::min(b.samples,
+                                                     total_samples)) /
+               b.samples;
+    } else if (seconds > 0) {
+      n = std::snprintf(buf, sizeof buf, "\r%5.1f%%",
+                        100 * std::min(b.seconds / seconds, 1.0));
+      left = std::max(seconds - b.seconds, 0.0);
+    } else {
+      n = std::snprintf(buf, sizeof buf, "\r%.3g M samples", b.samples * 1e-6);
+    }
+    n += std::snprintf(buf + n, sizeof buf - n, ", %.2f Mrays/s",
+                       (b.rays - a.rays) * 1e-6 / dt);
+    if (left >= 0) {
+      auto s = static_cast<long>(left + 0.5);
+      n += std::snprintf(buf + n, sizeof buf - n, ", %ld:%02ld left", s / 60,
+                         s % 60);
+    }
+    std::snprintf(buf + n, sizeof buf - n, ", %.0f%% busy   ",
+                  b.busy.empty()
+                      ? 0.0
+                      : std::min(100 * busy / (dt * b.busy.size()), 100.0));
+    std::cerr << buf << std::flush;
+  }
+};
+
+} // namespace raytracer
+
+#endif // TELEMETRY_H_
@@ -0,0 +1,124 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include "numa.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace raytracer {
+
+// Fixed set of worker threads that live as long as the pool. run() hands
+// the same job to every thread, the caller included as thread 0, and
+// returns once all of them are done, so a job costs two wake-ups instead of
+// thread creation. Thread locals of the workers, such as the RNG slots,
+// survive from one job to the next.
+class thread_pool {
+public:
+  // threads = 0 uses one thread per hardware thread. With a topology the
+  // threads are split into contiguous blocks, one per NUMA node, and pinned
+  // to their node's CPUs. Thread 0 is whichever thread calls run(); it is
+  // pinned only while the job runs.
+  explicit thread_pool(int threads = 0,
+                       const numa_topology *topology = nullptr) {
+    if (threads <= 0)
+      threads = std::max(1U, std::thread::hardware_concurrency());
+    const int nodes = topology ? std::min(topology->size(), threads) : 1;
+    for (int k = 0; k < threads; ++k)
+      thread_node.push_back(k * nodes / threads);
+    node_count = nodes;
+    if (topology)
+      caller_cpus = topology->nodes[thread_node[0]];
+    for (int k = 1; k < threads; ++k) {
+      std::vector<int> cpus;
+      if (topology)
+        cpus = topology->nodes[thread_node[k]];
+      workers.emplace_back([this, k, cpus] {
+        if (!cpus.empty())
+          pin_thread(cpus);
+        work(k);
+      });
+    }
+  }
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    start.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  int size() const { return static_cast<int>(workers.size()) + 1; }
+
+  // NUMA node of a thread and the number of nodes, 1 without a topology.
+  int node(int thread) const { return thread_node[thread]; }
+  int nodes() const { return node_count; }
+
+  // Runs job(thread) for thread = 0 .. size() - 1 concurrently, the calling
+  // thread being thread 0. Jobs run one at a time: a call made while another
+  // thread's job runs waits for it. A job must not call run() itself.
+  void run(const std::function<void(int)> &_job) {
+    std::lock_guard<std::mutex> serial(run_mutex);
+    pin_scope pinned(caller_cpus);
+    if (workers.empty()) {
+      _job(0);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &_job;
+      pending = static_cast<int>(workers.size());
+      ++generation;
+    }
+    start.notify_all();
+    _job(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pending == 0; });
+    job = nullptr;
+  }
+
+private:
+  std::vector<int> thread_node;
+  int node_count = 1;
+  std::vector<int> caller_cpus; // of thread 0, empty when not pinned
+  std::vector<std::thread> workers;
+  std::mutex run_mutex; // held by the thread whose job runs
+  std::mutex mutex;
+  std::condition_variable start, done;
+  const std::function<void(int)> *job = nullptr;
+  uint64_t generation = 0;
+  int pending = 0;
+  bool stopping = false;
+
+  void work(int index) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      start.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      auto current = job;
+      lock.unlock();
+      (*current)(index);
+      lock.lock();
+      if (--pending == 0)
+        done.notify_one();
+    }
+  }
+};
+
+} // namespace raytracer
+
+#endif // THREAD_POOL_H_
@@ -0,0 +1,233 @@
+#ifndef TILE_SCHEDULER_H_
+#define TILE_SCHEDULER_H_
+
+#include "random.hpp"
+#include "thread_pool.hpp"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace raytracer {
+
+struct tile {
+  int x0, y0, x1, y1;
+  int view = 0; // image the tile belongs to when several render at once
+};
+
+enum class tile_order {
+  hilbert,    // neighbouring tiles close together, for cache locality
+  morton,     // Z order, cheaper to compute, slightly worse locality
+  interleaved // spread out, so any prefix of the list covers the image
+};
+
+// Position of index d along the Hilbert curve filling an n x n grid, n a
+// power of two.
+inline void hilbert_d2xy(uint32_t n, uint32_t d, uint32_t &x, uint32_t &y) {
+  x = y = 0;
+  for (uint32_t s = 1; s < n; s *= 2) {
+    uint32_t rx = 1 & (d / 2);
+    uint32_t ry = 1 & (d ^ rx);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+    x += s * rx;
+    y += s * ry;
+    d /= 4;
+  }
+}
+
+// Splits a width x height image into tiles of tile_size pixels and returns
+// them in the given order.
+inline std::vector<tile> make_tiles(int width, int height, int tile_size,
+                                    tile_order order = tile_order::hilbert) {
+  const int ts = std::max(tile_size, 1);
+  const int tiles_x = (width + ts - 1) / ts, tiles_y = (height + ts - 1) / ts;
+  uint32_t n = 1;
+  while (n < static_cast<uint32_t>(std::max(tiles_x, tiles_y)))
+    n *= 2;
+
+  std::vector<tile> tiles;
+  tiles.reserve(tiles_x * tiles_y);
+  for (uint32_t d = 0; d < n * n; ++d) {
+    uint32_t tx = 0, ty = 0;
+    if (order == tile_order::hilbert) {
+      hilbert_d2xy(n, d, tx, ty);
+    } else {
+      for (int b = 0; b < 16; ++b) {
+        tx |= ((d >> (2 * b)) & 1) << b;
+        ty |= ((d >> (2 * b + 1)) & 1) << b;
+      }
+    }
+    if (tx < static_cast<uint32_t>(tiles_x) &&
+        ty < static_cast<uint32_t>(tiles_y))
+      tiles.push_back({static_cast<int>(tx) * ts, static_cast<int>(ty) * ts,
+                       std::min(width, static_cast<int>(tx + 1) * ts),
+                       std::min(height, static_cast<int>(ty + 1) * ts)});
+  }
+
+  if (order == tile_order::interleaved) {
+    // Bit reversed positions along the Hilbert curve.
+    auto hilbert = make_tiles(width, height, tile_size, tile_order::hilbert);
+    int bits = 0;
+    while ((size_t{1} << bits) < hilbert.size())
+      ++bits;
+    tiles.clear();
+    for (uint32_t k = 0; k < (1U << bits); ++k) {
+      auto i = bits ? reverse_bits(k) >> (32 - bits) : 0;
+      if (i < hilbert.size())
+        tiles.push_back(hilbert[i]);
+    }
+  }
+  return tiles;
+}
+
+// Counters of one parallel_tiles call.
+struct scheduler_stats {
+  double wall = 0;              // seconds
+  std::vector<double> busy;     // seconds per thread spent in tiles
+  std::vector<uint32_t> tiles;  // tiles run per thread
+  std::vector<uint32_t> steals; // tiles taken from other threads
+  std::vector<uint32_t> remote_steals; // of those, from other NUMA nodes
+
+  // Fraction of thread time spent working.
+  double utilization() const {
+    double total = 0;
+    for (auto b : busy)
+      total += b;
+    return wall > 0 && !busy.empty() ? total / (wall * busy.size()) : 1;
+  }
+};
+
+// A tile queue per thread. The owner takes tiles from the front, so it
+// walks its share of the curve in order; idle threads steal from the back,
+// far from where the owner is working. Tiles are coarse, so a mutex per
+// queue costs nothing measurable. Queues sit on separate cache lines.
+class alignas(64) tile_deque {
+public:
+  void push(const tile &t) { tiles.push_back(t); }
+
+  std::optional<tile> pop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tiles.empty())
+      return std::nullopt;
+    auto t = tiles.front();
+    tiles.pop_front();
+    return t;
+  }
+
+  std::optional<tile> steal() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tiles.empty())
+      return std::nullopt;
+    auto t = tiles.back();
+    tiles.pop_back();
+    return t;
+  }
+
+private:
+  std::mutex mutex;
+  std::deque<tile> tiles;
+};
+
+// Runs fn(tile, thread) for every tile, on the threads of pool or, without
+// one, on an OpenMP team. Each thread starts with a contiguous run of the
+// list, so with a Hilbert order its tiles are neighbours; a thread that runs
+// dry steals from the others, starting at a random victim. The threads of a
+// NUMA node are contiguous in the pool, so every node starts with one region
+// of the image, and threads steal from other nodes only once their own
+// node's queues are empty. stop() is polled before every tile, and once it
+// returns true remaining tiles are skipped.
+template <typename Fn, typename Stop>
+inline scheduler_stats parallel_tiles(thread_pool *pool,
+                                      const std::vector<tile> &tiles, Fn fn,
+                                      Stop stop) {
+  using clock = std::chrono::steady_clock;
+  const int threads = pool ? pool->size() : std::max(1, omp_get_max_threads());
+  std::vector<tile_deque> queues(threads);
+  for (size_t k = 0; k < tiles.size(); ++k)
+    queues[k * threads / tiles.size()].push(tiles[k]);
+
+  scheduler_stats stats;
+  stats.busy.assign(threads, 0);
+  stats.tiles.assign(threads, 0);
+  stats.steals.assign(threads, 0);
+  stats.remote_steals.assign(threads, 0);
+  std::atomic<bool> stopped = false;
+  const auto start = clock::now();
+
+  auto work = [&](int self) {
+    // Counted locally and stored once, so that threads do not write to
+    // neighbouring elements of the stats vectors while they work.
+    double busy = 0;
+    uint32_t done = 0, steals = 0, remote_steals = 0;
+    uint64_t rng = hash32(self, 0x7c3a) | 1;
+    const int node = pool ? pool->node(self) : 0;
+    for (;;) {
+      auto t = queues[self].pop();
+      if (!t) {
+        // Steal, trying every other queue once from a random start, those
+        // on the same node first.
+        auto first = static_cast<int>(splitmix64(rng) % threads);
+        for (int remote = 0; remote < 2 && !t; ++remote)
+          for (int k = 0; k < threads && !t; ++k) {
+            auto victim = (first + k) % threads;
+            const bool local = !pool || pool->node(victim) == node;
+            if (victim == self || local == static_cast<bool>(remote))
+              continue;
+            if ((t = queues[victim].steal())) {
+              ++steals;
+              remote_steals += remote;
+            }
+          }
+        if (!t)
+          break;
+      }
+      if (stopped.load(std::memory_order_relaxed))
+        continue;
+      if (stop()) {
+        stopped = true;
+        continue;
+      }
+      auto t0 = clock::now();
+      fn(*t, self);
+      busy += std::chrono::duration<double>(clock::now() - t0).count();
+      ++done;
+    }
+    stats.busy[self] = busy;
+    stats.tiles[self] = done;
+    stats.steals[self] = steals;
+    stats.remote_steals[self] = remote_steals;
+  };
+
+  if (pool) {
+    pool->run(work);
+  } else {
+#pragma omp parallel num_threads(threads)
+    work(omp_get_thread_num());
+  }
+
+  stats.wall = std::chrono::duration<double>(clock::now() - start).count();
+  return stats;
+}
+
+template <typename Fn>
+inline scheduler_stats parallel_tiles(thread_pool *pool,
+                                      const std::vector<tile> &tiles, Fn fn) {
+  return parallel_tiles(pool, tiles, fn, [] { return false; });
+}
+
+} // namespace raytracer
+
+#endif // TILE_SCHEDULER_H_
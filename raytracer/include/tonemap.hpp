@@ -0,0 +1,101 @@
+#ifndef TONEMAP_H_
+#define TONEMAP_H_
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace raytracer {
+
+// Curve mapping linear radiance to [0, 1] before the gamma 2 encoding.
+// clamp cuts off at 1, as the renderer always did; reinhard is x / (1 + x);
+// aces is Narkowicz's fit of the ACES filmic curve.
+enum class tonemap_curve { clamp, reinhard, aces };
+
+inline bool parse_tonemap_curve(const std::string &name,
+                                tonemap_curve &curve) {
+  if (name == "clamp")
+    curve = tonemap_curve::clamp;
+  else if (name == "reinhard")
+    curve = tonemap_curve::reinhard;
+  else if (name == "aces")
+    curve = tonemap_curve::aces;
+  else
+    return false;
+  return true;
+}
+
+struct tonemap_settings {
+  double exposure = 0; // in stops, each doubling the radiance
+  tonemap_curve curve = tonemap_curve::clamp;
+};
+
+namespace detail {
+
+// Clamps by comparing bit patterns as integers, which order like the floats
+// they encode when not negative. Float comparisons would not vectorize
+// unless FP traps were turned off for the build.
+inline float non_negative(float x) {
+  return std::bit_cast<float>(std::max(std::bit_cast<int32_t>(x), 0));
+}
+
+inline float clamp_unit(float x) {
+  return std::bit_cast<float>(
+      std::min(std::max(std::bit_cast<int32_t>(x), 0), 0x3f800000));
+}
+
+// Square root of v in [0, 1] by two Newton steps from a bit pattern guess.
+// std::sqrt would not vectorize, as it may set errno. Encoded to 8 bits
+// it matches std::sqrt for all but 383 floats in [0, 1], each within a few
+// ulp below a level boundary and one level off.
+inline float sqrt_unit(float v) {
+  auto s = std::bit_cast<float>((std::bit_cast<int32_t>(v) >> 1) + 0x1fbd1df5);
+  s = 0.5f * (s + v / s);
+  return 0.5f * (s + v / s);
+}
+
+// One loop per curve, so that each vectorizes.
+template <typename Curve>
+inline void tonemap_rgb8(const float *linear, size_t n, float scale,
+                         uint8_t *out, Curve curve) {
+#pragma omp simd
+  for (size_t k = 0; k < n; ++k) {
+    float v = clamp_unit(curve(non_negative(linear[k] * scale)));
+    // Clamped after the conversion, as float comparisons before it would
+    // stop the loop from vectorizing too.
+    out[k] = static_cast<uint8_t>(
+        std::min(static_cast<int32_t>(256.0f * sqrt_unit(v)), 255));
+  }
+}
+
+} // namespace detail
+
+// Maps n linear values to 8 bits: scales them by the exposure, applies the
+// curve, clamps to [0, 1] and encodes with gamma 2. Negative values become
+// 0.
+inline void tonemap_rgb8(const float *linear, size_t n,
+                         const tonemap_settings &settings, uint8_t *out) {
+  const float scale = std::exp2(static_cast<float>(settings.exposure));
+  switch (settings.curve) {
+  case tonemap_curve::clamp:
+    detail::tonemap_rgb8(linear, n, scale, out,
+                         [](float x) { return x; });
+    break;
+  case tonemap_curve::reinhard:
+    detail::tonemap_rgb8(linear, n, scale, out,
+                         [](float x) { return x / (1.0f + x); });
+    break;
+  case tonemap_curve::aces:
+    detail::tonemap_rgb8(linear, n, scale, out, [](float x) {
+      return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+    });
+    break;
+  }
+}
+
+} // namespace raytracer
+
+#endif // TONEMAP_H_
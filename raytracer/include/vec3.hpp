@@ -1,8 +1,10 @@
 #ifndef _VEC3
 #define _VEC3
 
+#include <algorithm>
 #include <assert.h>
 #include <cmath>
+#include <numbers>
 #include <ostream>
 
 namespace raytracer {
@@ -70,7 +72,7 @@ public:
 
   bool near_zero() const {
     const auto s = 1e-8;
-    return (fabs(e[0] < s) && fabs(e[1] < s) && fabs(e[2] < s));
+    return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
   }
 
   double length() const { return sqrt(length_squared()); }
@@ -112,26 +114,64 @@ template <typename T> inline Vec3<T> unit_vector(const Vec3<T> &v) {
   return v / v.length();
 }
 
-template <typename T> inline Vec3<T> random_in_unit_sphere() {
-  while (true) {
-    auto p = Vec3<T>::random(-1, 1);
-    if (p.length() >= 1)
-      continue;
-    return p;
+// Closed form warps from uniform values in [0,1) to common distributions.
+// Each takes a fixed number of inputs, so low discrepancy samplers can drive
+// them and there are no rejection loops.
+
+// Uniform on the unit sphere.
+template <typename T> inline Vec3<T> sample_uniform_sphere(T u1, T u2) {
+  auto z = 1 - 2 * u1;
+  auto r = sqrt(std::max(T(0), 1 - z * z));
+  auto phi = 2 * std::numbers::pi_v<T> * u2;
+  return Vec3<T>(r * cos(phi), r * sin(phi), z);
+}
+
+// Uniform in the unit disk in the xy plane, by Shirley and Chiu's concentric
+// mapping, which keeps strata of the square compact on the disk.
+template <typename T> inline Vec3<T> sample_concentric_disk(T u1, T u2) {
+  auto a = 2 * u1 - 1;
+  auto b = 2 * u2 - 1;
+  if (a == 0 && b == 0)
+    return Vec3<T>(0, 0, 0);
+
+  constexpr auto quarter_pi = std::numbers::pi_v<T> / 4;
+  T r, phi;
+  if (fabs(a) > fabs(b)) {
+    r = a;
+    phi = quarter_pi * (b / a);
+  } else {
+    r = b;
+    phi = 2 * quarter_pi - quarter_pi * (a / b);
   }
+  return Vec3<T>(r * cos(phi), r * sin(phi), 0);
+}
+
+// Cosine weighted on the hemisphere around +z.
+template <typename T> inline Vec3<T> sample_cosine_hemisphere(T u1, T u2) {
+  auto d = sample_concentric_disk(u1, u2);
+  auto z = sqrt(std::max(T(0), 1 - d.x() * d.x() - d.y() * d.y()));
+  return Vec3<T>(d.x(), d.y(), z);
+}
+
+// Uniform in the unit ball.
+template <typename T> inline Vec3<T> sample_uniform_ball(T u1, T u2, T u3) {
+  return sample_uniform_sphere(u1, u2) * std::cbrt(u3);
+}
+
+template <typename T> inline Vec3<T> random_in_unit_sphere() {
+  auto u1 = random_draw<T>();
+  auto u2 = random_draw<T>();
+  return sample_uniform_ball(u1, u2, random_draw<T>());
 }
 
 template <typename T> inline Vec3<T> random_in_unit_disk() {
-  while (true) {
-    auto p = Vec3<T>(random_draw<T>(-1, 1), random_draw<T>(-1, 1), 0);
-    if (p.length_squared() >= 1)
-      continue;
-    return p;
-  }
+  auto u1 = random_draw<T>();
+  return sample_concentric_disk(u1, random_draw<T>());
 }
 
 template <typename T> inline Vec3<T> random_unit_vector() {
-  return unit_vector<T>(random_in_unit_sphere<T>());
+  auto u1 = random_draw<T>();
+  return sample_uniform_sphere(u1, random_draw<T>());
 }
 
 template <typename T>
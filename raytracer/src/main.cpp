@@ -1,182 +1,664 @@
 #include "rtweekend.hpp"
 
+#include "animation.hpp"
 #include "camera.hpp"
+#include "checkpoint.hpp"
 #include "color.hpp"
+#include "denoise.hpp"
+#include "distributed.hpp"
 #include "hittable_list.hpp"
 #include "material.hpp"
+#include "output.hpp"
+#include "partial.hpp"
+#include "render.hpp"
+#include "render_server.hpp"
+#include "renderer.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "scenes.hpp"
 #include "sphere.hpp"
 
-#include <atomic>
-#include <iostream>
 #include <omp.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
 #include <vector>
 
 using namespace raytracer;
 
-hittable_list random_scene() {
-  hittable_list world;
-
-  auto checker =
-      make_shared<checker_texture>(Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
-  world.add(make_shared<sphere>(Point(0, -1000, 0), 1000,
-                                make_shared<lambertian>(checker)));
-
-  for (int a = -11; a < 11; a++) {
-    for (int b = -11; b < 11; b++) {
-      auto choose_mat = random_draw<double>();
-      Point center(a + 0.9 * random_draw<double>(), 0.2,
-                   b + 0.9 * random_draw<double>());
-
-      if ((center - Point(4, 0.2, 0)).length() > 0.9) {
-        shared_ptr<material> sphere_material;
-
-        if (choose_mat < 0.8) {
-          // diffuse
-          auto albedo = mult_col(Color::random(), Color::random());
-          sphere_material = make_shared<lambertian>(albedo);
-          auto center2 = center + Vector(0, random_draw<double>(0, .5), 0);
-          world.add(make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2,
-                                               sphere_material));
-        } else if (choose_mat < 0.95) {
-          // metal
-          auto albedo = Color::random(0.5, 1);
-          auto fuzz = random_draw<double>(0, 0.5);
-          sphere_material = make_shared<metal>(albedo, fuzz);
-          world.add(make_shared<sphere>(center, 0.2, sphere_material));
-        } else {
-          // glass
-          sphere_material = make_shared<dielectric>(1.5);
-          world.add(make_shared<sphere>(center, 0.2, sphere_material));
-        }
-      }
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void on_signal(int) { interrupted = 1; }
+
+// Starts `count` copies of this program as render workers for the
+// coordinator at address. They get the same options, which make them build
+// the same scene, and share the machine's threads.
+static std::vector<pid_t> spawn_workers(int argc, char **argv,
+                                        const std::string &address,
+                                        int count) {
+  std::vector<std::string> args{argv[0]};
+  for (int a = 1; a < argc; ++a) {
+    if ((!std::strcmp(argv[a], "--workers") ||
+         !std::strcmp(argv[a], "--listen")) &&
+        a + 1 < argc) {
+      ++a;
+      continue;
     }
+    args.push_back(argv[a]);
   }
-
-  auto material1 = make_shared<dielectric>(1.5);
-  world.add(make_shared<sphere>(Point(0, 1, 0), 1.0, material1));
-
-  auto material2 = make_shared<lambertian>(Color(0.4, 0.2, 0.1));
-  world.add(make_shared<sphere>(Point(-4, 1, 0), 1.0, material2));
-
-  auto material3 = make_shared<metal>(Color(0.7, 0.6, 0.5), 0.0);
-  world.add(make_shared<sphere>(Point(4, 1, 0), 1.0, material3));
-
-  return world;
-}
-
-hittable_list two_spheres() {
-  hittable_list objects;
-
-  auto checker =
-      make_shared<checker_texture>(Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
-
-  objects.add(make_shared<sphere>(Point(0, -10, 0), 10,
-                                  make_shared<lambertian>(checker)));
-
-  auto pertext = make_shared<noise_texture>();
-  objects.add(make_shared<sphere>(Point(0, 10, 0), 10,
-                                  make_shared<lambertian>(pertext)));
-
-  auto sphere_material = make_shared<dielectric>(1.5);
-  objects.add(make_shared<sphere>(Point(3, 0, 3), 1, sphere_material));
-  // metal
-  // auto albedo = Color::random(0.5, 1);
-  // auto fuzz = random_draw<double>(0, 0.5);
-  // auto sphere_material_m = make_shared<metal>(albedo, fuzz);
-  // objects.add(make_shared<sphere>(Point(3, 0, -3), 1, sphere_material_m));
-
-  return objects;
-}
-
-hittable_list two_perlin_spheres() {
-  hittable_list objects;
-
-  auto pertext = make_shared<noise_texture>(4);
-  objects.add(make_shared<sphere>(Point(0, -1000, 0), 1000,
-                                  make_shared<lambertian>(pertext)));
-  objects.add(
-      make_shared<sphere>(Point(0, 2, 0), 2, make_shared<lambertian>(pertext)));
-
-  return objects;
+  args.push_back("--worker");
+  args.push_back(address);
+  std::vector<char *> c_args;
+  for (auto &arg : args)
+    c_args.push_back(arg.data());
+  c_args.push_back(nullptr);
+
+  // Everything is prepared before fork(), as the child of a threaded
+  // process may only make async-signal-safe calls before execv().
+  const char *old_threads = std::getenv("OMP_NUM_THREADS");
+  const std::string saved = old_threads ? old_threads : "";
+  setenv("OMP_NUM_THREADS",
+         std::to_string(std::max(1, omp_get_max_threads() / count)).c_str(),
+         1);
+  std::vector<pid_t> pids;
+  for (int k = 0; k < count; ++k) {
+    auto pid = fork();
+    if (pid == 0) {
+      execv(argv[0], c_args.data());
+      _exit(127);
+    }
+    if (pid > 0)
+      pids.push_back(pid);
+  }
+  if (old_threads)
+    setenv("OMP_NUM_THREADS", saved.c_str(), 1);
+  else
+    unsetenv("OMP_NUM_THREADS");
+  return pids;
 }
 
-hittable_list earth() {
-  auto earth_texture = make_shared<image_texture>("../../data/earth.jpg");
-  auto earth_surface = make_shared<lambertian>(earth_texture);
-  auto globe = make_shared<sphere>(Point(0, 0, 0), 2, earth_surface);
-
-  return hittable_list(globe);
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options] > image.ppm\n"
+            << "  --scene NAME     random, two_spheres, two_perlin_spheres, "
+               "simple_light or earth (default)\n"
+            << "  --sampler NAME   independent, halton, sobol (default) or "
+               "bluenoise\n"
+            << "  --spp N          samples per pixel (default 50)\n"
+            << "  --seed N         random seed\n"
+            << "  --adaptive       adaptive sampling, --spp is the average\n"
+            << "  --threshold X    relative error a pixel must reach "
+               "(default 0.01)\n"
+            << "  --max-spp N      adaptive sample cap per pixel "
+               "(default 1024)\n"
+            << "  --progressive    render in passes, --spp 0 runs until "
+               "interrupted\n"
+            << "  --pass-spp N     samples per pixel per pass (default 1)\n"
+            << "  --write-every S  write the image every S seconds while "
+               "rendering\n"
+            << "  --output FILE    write the image to FILE instead of stdout\n"
+            << "  --format NAME    ppm (default), png, jpg or raw, or linear "
+               "pfm, hdr or exr;\n"
+            << "                   by default that of the --output "
+               "extension\n"
+            << "  --exposure EV    scale 8 bit images by 2^EV before "
+               "tonemapping (default 0)\n"
+            << "  --tonemap CURVE  clamp (default), reinhard or aces for 8 bit "
+               "images\n"
+            << "  --time-budget S  render for S seconds, --spp caps the "
+               "samples if given\n"
+            << "  --spp-map FILE   write per pixel sample counts as PGM "
+               "(default FILE.spp.pgm\n"
+            << "                   next to --output with --time-budget)\n"
+            << "  --checkpoint F   save the render state to F while rendering\n"
+            << "  --checkpoint-every S  seconds between checkpoints "
+               "(default 60)\n"
+            << "  --resume         continue from the --checkpoint file if it "
+               "exists\n"
+            << "  --denoise        filter the final image, guided by "
+               "albedo, normal and depth\n"
+            << "  --feature-spp N  trace N camera rays per pixel for the "
+               "denoiser features\n"
+            << "                   instead of recording them during the "
+               "render\n"
+            << "  --aov LIST       write albedo, normal, depth, id and/or "
+               "motion as FILE.NAME.pfm\n"
+            << "                   (aov.NAME.pfm without --output)\n"
+            << "  --tile-size N    tile edge in pixels (default 16)\n"
+            << "  --tile-order O   hilbert (default), morton or interleaved\n"
+            << "  --numa MODE      off (default), pin threads to NUMA nodes, "
+               "or replicate\n"
+            << "                   the scene on every node as well\n"
+            << "  --listen ADDR    render with worker processes that connect "
+               "to ADDR,\n"
+            << "                   host:port or unix:/path\n"
+            << "  --workers N      start N local worker processes (on a "
+               "Unix socket\n"
+            << "                   unless --listen is given)\n"
+            << "  --worker ADDR    render tiles for the coordinator at ADDR, "
+               "started with\n"
+            << "                   the same scene options\n"
+            << "  --server ADDR    render on the render_server at ADDR, which "
+               "keeps scenes\n"
+            << "                   loaded between runs\n"
+            << "  --views N        render N views around the scene at once, "
+               "written to\n"
+            << "                   FILE.K.EXT (view.K.EXT without --output)\n"
+            << "  --partial FILE   also write the sample sums to FILE, to be "
+               "combined with\n"
+            << "                   merge_partials\n"
+            << "  --sample-offset N  first sample index, so that partials "
+               "cover disjoint\n"
+            << "                   samples (default 0)\n"
+            << "  --animate N      render N frames of the camera circling the "
+               "scene, written\n"
+            << "                   to FILE.NNNN.EXT (frame.NNNN.EXT without "
+               "--output)\n";
 }
 
-int main() {
+int main(int argc, char **argv) {
+
+  // Options
+
+  std::string scene_name = "earth";
+  std::string sampler_name = "sobol";
+  int samples_per_pixel = 50;
+  render_settings settings;
+  bool progressive = false;
+  double write_every = 0;
+  std::string output;
+  std::string format;
+  tonemap_settings tonemap;
+  double time_budget = 0;
+  bool spp_given = false;
+  std::string spp_map;
+  std::string checkpoint;
+  double checkpoint_every = 60;
+  bool resume = false;
+  bool denoise_output = false;
+  int feature_samples = 0;
+  numa_mode numa = numa_mode::off;
+  std::string listen_address;
+  int local_workers = 0;
+  std::string worker_address;
+  std::string server_address;
+  int views = 0;
+  int frames = 0;
+  std::string partial_path;
+
+  for (int a = 1; a < argc; ++a) {
+    auto has_value = a + 1 < argc;
+    if (!std::strcmp(argv[a], "--scene") && has_value) {
+      scene_name = argv[++a];
+    } else if (!std::strcmp(argv[a], "--sampler") && has_value) {
+      sampler_name = argv[++a];
+    } else if (!std::strcmp(argv[a], "--spp") && has_value) {
+      samples_per_pixel = std::stoi(argv[++a]);
+      spp_given = true;
+    } else if (!std::strcmp(argv[a], "--seed") && has_value) {
+      set_rng_seed(std::stoull(argv[++a]));
+    } else if (!std::strcmp(argv[a], "--adaptive")) {
+      settings.adaptive = true;
+    } else if (!std::strcmp(argv[a], "--threshold") && has_value) {
+      settings.adaptive_threshold = std::stod(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--max-spp") && has_value) {
+      settings.adaptive_max_samples = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--progressive")) {
+      progressive = true;
+    } else if (!std::strcmp(argv[a], "--pass-spp") && has_value) {
+      settings.samples_per_pass = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--write-every") && has_value) {
+      write_every = std::stod(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--output") && has_value) {
+      output = argv[++a];
+    } else if (!std::strcmp(argv[a], "--format") && has_value) {
+      format = argv[++a];
+    } else if (!std::strcmp(argv[a], "--exposure") && has_value) {
+      tonemap.exposure = std::stod(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--tonemap") && has_value) {
+      if (!parse_tonemap_curve(argv[++a], tonemap.curve)) {
+        std::cerr << "Unknown tonemap curve '" << argv[a] << "'.\n";
+        return 1;
+      }
+    } else if (!std::strcmp(argv[a], "--time-budget") && has_value) {
+      time_budget = std::stod(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--spp-map") && has_value) {
+      spp_map = argv[++a];
+    } else if (!std::strcmp(argv[a], "--checkpoint") && has_value) {
+      checkpoint = argv[++a];
+    } else if (!std::strcmp(argv[a], "--checkpoint-every") && has_value) {
+      checkpoint_every = std::stod(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--resume")) {
+      resume = true;
+    } else if (!std::strcmp(argv[a], "--denoise")) {
+      denoise_output = true;
+    } else if (!std::strcmp(argv[a], "--feature-spp") && has_value) {
+      feature_samples = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--tile-size") && has_value) {
+      settings.tile_size = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--tile-order") && has_value) {
+      std::string order = argv[++a];
+      if (order == "hilbert")
+        settings.tile_order = tile_order::hilbert;
+      else if (order == "morton")
+        settings.tile_order = tile_order::morton;
+      else if (order == "interleaved")
+        settings.tile_order = tile_order::interleaved;
+      else {
+        std::cerr << "Unknown tile order '" << order << "'.\n";
+        return 1;
+      }
+    } else if (!std::strcmp(argv[a], "--numa") && has_value) {
+      std::string mode = argv[++a];
+      if (mode == "off")
+        numa = numa_mode::off;
+      else if (mode == "pin")
+        numa = numa_mode::pin;
+      else if (mode == "replicate")
+        numa = numa_mode::replicate;
+      else {
+        std::cerr << "Unknown NUMA mode '" << mode << "'.\n";
+        return 1;
+      }
+    } else if (!std::strcmp(argv[a], "--listen") && has_value) {
+      listen_address = argv[++a];
+    } else if (!std::strcmp(argv[a], "--workers") && has_value) {
+      local_workers = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--worker") && has_value) {
+      worker_address = argv[++a];
+    } else if (!std::strcmp(argv[a], "--server") && has_value) {
+      server_address = argv[++a];
+    } else if (!std::strcmp(argv[a], "--views") && has_value) {
+      views = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--partial") && has_value) {
+      partial_path = argv[++a];
+    } else if (!std::strcmp(argv[a], "--sample-offset") && has_value) {
+      settings.sample_offset = std::stoul(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--animate") && has_value) {
+      frames = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--aov") && has_value) {
+      if (!parse_aovs(argv[++a], settings.aovs)) {
+        std::cerr << "Unknown AOV in '" << argv[a] << "'.\n";
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (resume && checkpoint.empty()) {
+    std::cerr << "--resume needs --checkpoint.\n";
+    return 1;
+  }
+  // Checkpointed renders run in passes, which gives the same image.
+  if (!checkpoint.empty())
+    progressive = true;
+  if ((progressive || time_budget > 0) && settings.adaptive) {
+    std::cerr << "--adaptive cannot be combined with --progressive, "
+                 "--time-budget or --checkpoint.\n";
+    return 1;
+  }
+  const bool distributed = !listen_address.empty() || local_workers > 0;
+  if (distributed &&
+      (settings.adaptive || progressive || time_budget > 0 || settings.aovs ||
+       (denoise_output && feature_samples <= 0))) {
+    std::cerr << "Distributed rendering cannot be combined with --adaptive, "
+                 "--progressive,\n--time-budget, --checkpoint or --aov, and "
+                 "--denoise needs --feature-spp.\n";
+    return 1;
+  }
+  if (!server_address.empty() &&
+      (distributed || !worker_address.empty() || settings.adaptive ||
+       progressive || time_budget > 0 || settings.aovs || denoise_output)) {
+    std::cerr << "--server renders plain images and cannot be combined with "
+                 "distributed\nrendering, --adaptive, --progressive, "
+                 "--time-budget, --checkpoint, --aov\nor --denoise.\n";
+    return 1;
+  }
+  if ((views > 0 || frames > 0) &&
+      ((views > 0 && frames > 0) || distributed || !worker_address.empty() ||
+       !server_address.empty() || settings.adaptive || progressive ||
+       time_budget > 0 || settings.aovs || denoise_output)) {
+    std::cerr << "--views and --animate cannot be combined with each other, "
+                 "distributed\nrendering, --server, --adaptive, "
+                 "--progressive, --time-budget, --checkpoint,\n--aov or "
+                 "--denoise.\n";
+    return 1;
+  }
+  if (frames > 0 && numa == numa_mode::replicate) {
+    std::cerr << "--animate cannot be combined with --numa replicate, which "
+                 "would copy and\nrebuild the scene on every node for every "
+                 "frame; use --numa pin.\n";
+    return 1;
+  }
+  if (!partial_path.empty() &&
+      (settings.adaptive || time_budget > 0 || !server_address.empty() ||
+       views > 0 || frames > 0)) {
+    std::cerr << "--partial cannot be combined with --adaptive, "
+                 "--time-budget, --server,\n--views or --animate.\n";
+    return 1;
+  }
+  auto encoder = !format.empty()    ? make_image_writer(format, tonemap)
+                : !output.empty() ? image_writer_for(output, tonemap)
+                                  : make_image_writer("ppm", tonemap);
+  if (!encoder) {
+    std::cerr << "Unknown image format '" << format << "'.\n";
+    return 1;
+  }
+  if (write_every > 0 && output.empty()) {
+    std::cerr << "--write-every needs --output.\n";
+    return 1;
+  }
+  if (time_budget > 0 && spp_map.empty() && !output.empty())
+    spp_map = output + ".spp.pgm";
+  // AOVs the render was not asked for are only kept for the denoiser.
+  const unsigned output_aovs = settings.aovs;
+  if (denoise_output && feature_samples <= 0)
+    settings.aovs |= aov_albedo | aov_normal | aov_depth;
 
   // Image
 
   constexpr auto aspect_ratio = 16.0 / 9.0;
   constexpr int image_width = 400;
   constexpr int image_height = static_cast<int>(image_width / aspect_ratio);
-  const int samples_per_pixel = 50;
   const int max_depth = 25;
 
-  // World
-  // auto world = random_scene();
-  // hittable_list world;
-  // auto ground_material = make_shared<lambertian>(Color(0.5, 0.5, 0.5));
-  // world.add(make_shared<sphere>(Point(0, -1000, 0), 1000, ground_material));
-  // auto material1 = make_shared<dielectric>(0.4);
-  // world.add(make_shared<sphere>(Point(0, 1, -2), 1.0, material1));
-  // auto material3 = make_shared<metal>(Color(0.7, 0.6, 0.5), 0.3);
-  // world.add(make_shared<sphere>(Point(2, 1.2, 0), 1.2, material3));
-  // auto material4 = make_shared<texture>("./data/earth.jpg", 0.0);
-  // world.add(make_shared<sphere>(Point(0, 1.4, -3), 1.4, material4));
-  // auto world = random_scene();
-  auto world = earth();
+  settings.image_width = image_width;
+  settings.image_height = image_height;
+  settings.samples_per_pixel =
+      time_budget > 0 && !spp_given ? 0 : samples_per_pixel;
+  settings.max_depth = max_depth;
+
+  auto sampler = make_sampler(sampler_name);
+  if (!sampler) {
+    std::cerr << "Unknown sampler '" << sampler_name << "'.\n";
+    return 1;
+  }
 
   // Camera
-  Point lookfrom(13, 2, 3);
-  Point lookat(0, 0, 0);
-  Vector vup(0, 1, 0);
-  auto dist_to_focus = (lookfrom - lookat).length();
-  auto aperture = 0.1;
+  camera_params view;
+  view.aspect_ratio = aspect_ratio;
+  if (scene_name == "simple_light") {
+    view.lookfrom = Point(26, 3, 6);
+    view.lookat = Point(0, 2, 0);
+    view.aperture = 0.0;
+  }
+  view.focus_dist = (view.lookfrom - view.lookat).length();
+
+  if (!server_address.empty()) {
+    socket_address address;
+    if (!socket_address::parse(server_address, address)) {
+      std::cerr << "Bad address '" << server_address << "'.\n";
+      return 1;
+    }
+    render_job job;
+    job.scene = scene_name;
+    job.sampler = sampler_name;
+    job.seed = rng_seed();
+    job.width = image_width;
+    job.height = image_height;
+    job.samples_per_pixel = samples_per_pixel;
+    job.max_depth = max_depth;
+    job.tile_size = settings.tile_size;
+    job.camera = view;
+    framebuffer fb;
+    size_t tiles = 0;
+    if (!request_render(address, job, fb, [&](const tile &) {
+          std::cerr << "\rTiles: " << ++tiles << std::flush;
+        }))
+      return 1;
+    if (output.empty() ? !write_to_stdout(*encoder, fb)
+                       : !write_image(output, fb, *encoder))
+      return 1;
+    std::cerr << "\nDone, " << fb.total_samples() << " samples.\n";
+    return 0;
+  }
 
-  Camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus,
-             0.0, 1.0);
+  // World
 
-  // Buffer
-  std::vector<RGB> buf(image_height * image_width);
+  Scene scene;
+  if (!make_scene(scene_name, scene)) {
+    std::cerr << "Unknown scene '" << scene_name << "'.\n";
+    return 1;
+  }
+  scene.build(0.0, 1.0);
+  Camera cam = view.camera();
+
+  // Identifies the render for checkpoints and distributed workers. The
+  // sample count is left out so that a resumed render can be given more
+  // samples. Partials leave out the sample offset too, as merge_partial
+  // checks their ranges itself.
+  fingerprint key;
+  key.add(scene_name);
+  add_scene(key, scene, 0.0, 1.0);
+  key.add(view.lookfrom).add(view.lookat).add(view.vup).add(view.aperture);
+  key.add(view.focus_dist);
+  key.add(image_width).add(image_height).add(max_depth);
+  key.add(sampler_name).add(rng_seed());
+  const uint64_t partial_key = key.value();
+  key.add(settings.sample_offset).add(settings.exact_sums);
 
   // Render
 
-  std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+  if (!worker_address.empty()) {
+    socket_address address;
+    if (!socket_address::parse(worker_address, address)) {
+      std::cerr << "Bad address '" << worker_address << "'.\n";
+      return 1;
+    }
+    Renderer renderer(omp_get_max_threads(), numa);
+    settings.pool = &renderer.pool();
+    settings.progress = false;
+    return run_render_worker(address, key.value(), scene, cam, *sampler,
+                             settings)
+               ? 0
+               : 1;
+  }
+
+  // Local renders share one pool. A distributed coordinator only hands out
+  // tiles and makes none, so that no idle, pinned workers sit beside the
+  // workers it forks.
+  std::optional<Renderer> renderer;
+  if (!distributed)
+    renderer.emplace(omp_get_max_threads(), numa);
+  if (views > 0) {
+    // Turntable: the camera circles the vertical axis through lookat.
+    std::vector<Camera> cams;
+    const auto offset = view.lookfrom - view.lookat;
+    for (int k = 0; k < views; ++k) {
+      const auto angle = 2 * pi * k / views;
+      auto turned = view;
+      turned.lookfrom =
+          view.lookat + Vector(std::cos(angle) * offset.x() +
+                                   std::sin(angle) * offset.z(),
+                               offset.y(),
+                               std::cos(angle) * offset.z() -
+                                   std::sin(angle) * offset.x());
+      cams.push_back(turned.camera());
+    }
+    auto fbs = renderer->render_views(scene, cams, *sampler, settings);
+    const auto base = output.empty() ? std::string("view") : output;
+    for (int k = 0; k < views; ++k)
+      if (!write_image(base + "." + std::to_string(k) + "." +
+                           encoder->extension(),
+                       fbs[k], *encoder))
+        return 1;
+    std::cerr << "\nDone, " << views << " views.\n";
+    return 0;
+  }
+
+  if (frames > 0) {
+    // The camera circles the vertical axis through lookat once, through a
+    // key every 15 degrees. Moving objects move over the scene's interval.
+    keyframes<camera_params> path;
+    const auto offset = view.lookfrom - view.lookat;
+    for (int k = 0; k <= 24; ++k) {
+      const auto angle = 2 * pi * k / 24;
+      auto key = view;
+      key.lookfrom = view.lookat + Vector(std::cos(angle) * offset.x() +
+                                              std::sin(angle) * offset.z(),
+                                          offset.y(),
+                                          std::cos(angle) * offset.z() -
+                                              std::sin(angle) * offset.x());
+      path.add(static_cast<double>(k) / 24, key);
+    }
+    animation_settings anim;
+    anim.frames = frames;
+    const auto base = output.empty() ? std::string("frame") : output;
+    animation_stats stats;
+    bool ok = render_animation(
+        *renderer, scene, path, *sampler, settings, anim,
+        [&](int frame, const framebuffer &fb) {
+          char number[16];
+          std::snprintf(number, sizeof number, ".%04d.", frame);
+          return write_image(base + number + encoder->extension(), fb,
+                             *encoder);
+        },
+        stats);
+    std::cerr << "\n" << stats.frames << " frames in " << stats.seconds
+              << " s (" << stats.frames_per_hour() << " frames/hour): "
+              << stats.render << " s rendering, " << stats.refit
+              << " s refitting, " << stats.write_stall
+              << " s waiting for writes.\n";
+    return ok ? 0 : 1;
+  }
 
-  // update
-  std::atomic<unsigned int> count = 0;
-  unsigned int percentage = 0;
+  framebuffer fb;
+  if (progressive || time_budget > 0) {
+    // Stop after the current pass on Ctrl-C and keep what has been rendered.
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    settings.progress = false;
+
+    fb = framebuffer(image_width, image_height, settings.aovs);
+    if (resume && std::ifstream(checkpoint)) {
+      if (!load_checkpoint(checkpoint, fb, key.value()))
+        return 1;
+      std::cerr << "Resuming from '" << checkpoint << "' at "
+                << fb.total_samples() << " samples.\n";
+    }
+    std::optional<checkpoint_writer> writer;
+    if (!checkpoint.empty())
+      writer.emplace(checkpoint, key.value());
+
+    using clock = std::chrono::steady_clock;
+    auto last_write = clock::now();
+    auto last_checkpoint = clock::now();
+    auto after_pass = [&](const framebuffer &fb, int) {
+      auto now = clock::now();
+      if (write_every > 0 &&
+          std::chrono::duration<double>(now - last_write).count() >=
+              write_every) {
+        write_image(output, fb, *encoder);
+        last_write = now;
+      }
+      if (writer &&
+          std::chrono::duration<double>(now - last_checkpoint).count() >=
+              checkpoint_every) {
+        writer->submit(fb);
+        last_checkpoint = now;
+      }
+      return !interrupted;
+    };
+
+    {
+      render_telemetry telemetry(renderer->threads());
+      const uint64_t total =
+          static_cast<uint64_t>(fb.count.size()) * settings.samples_per_pixel;
+      progress_reporter reporter(
+          telemetry, total > fb.total_samples() ? total - fb.total_samples() : 0,
+          time_budget);
+      settings.telemetry = &telemetry;
+      if (time_budget > 0)
+        renderer->render_timed(scene, cam, *sampler, settings, fb,
+                               time_budget, after_pass);
+      else
+        renderer->render_progressive(scene, cam, *sampler, settings, fb,
+                                     after_pass);
+      settings.telemetry = nullptr;
+    }
 
-#pragma omp parallel for
-  for (int j = image_height - 1; j >= 0; --j) {
-    count++;
-    if (count > static_cast<unsigned int>((image_height * 0.1))) {
-      count = 0;
-      percentage += 10;
-      std::cerr << "\rCompleted: " << percentage << "%" << std::flush;
+    // Wait for a checkpoint in flight, then write the final state.
+    writer.reset();
+    if (!checkpoint.empty() && !save_checkpoint(checkpoint, fb, key.value()))
+      return 1;
+  } else if (distributed) {
+    if (listen_address.empty())
+      listen_address =
+          "unix:/tmp/raytracer-" + std::to_string(getpid()) + ".sock";
+    socket_address address;
+    if (!socket_address::parse(listen_address, address)) {
+      std::cerr << "Bad address '" << listen_address << "'.\n";
+      return 1;
     }
-    for (int i = 0; i < image_width; ++i) {
-      Color pixel_color(0, 0, 0);
-      for (int s = 0; s < samples_per_pixel; ++s) {
-        auto u = (i + random_draw<double>()) / (image_width - 1);
-        auto v = (j + random_draw<double>()) / (image_height - 1);
-        Ray r = cam.get_ray(u, v);
-        pixel_color += ray_color(r, world, max_depth);
+    auto listener = listen_on(address);
+    if (!listener)
+      return 1;
+    std::vector<pid_t> pids;
+    if (local_workers > 0)
+      pids = spawn_workers(argc, argv, listen_address, local_workers);
+
+    fb = framebuffer(image_width, image_height);
+    distributed_settings dist;
+    distributed_stats stats;
+    bool ok = render_distributed(listener.get(), key.value(), fb,
+                                 settings.samples_per_pixel, dist, stats);
+    // Workers exit on bye; stuck ones are killed after a grace period.
+    auto grace = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    for (auto pid : pids) {
+      if (!ok)
+        kill(pid, SIGTERM);
+      while (waitpid(pid, nullptr, WNOHANG) == 0) {
+        if (std::chrono::steady_clock::now() > grace) {
+          kill(pid, SIGKILL);
+          waitpid(pid, nullptr, 0);
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
       }
-      write_color(buf, j, i, image_width, pixel_color, samples_per_pixel);
-      // write_color(std::cout, pixel_color, samples_per_pixel);
     }
+    if (address.unix_domain)
+      unlink(address.path.c_str());
+    if (!ok)
+      return 1;
+    std::cerr << "\n" << stats.workers << " workers, " << stats.lost
+              << " lost, " << stats.reissued << " tiles reissued.";
+  } else {
+    fb = renderer->render(scene, cam, *sampler, settings);
+  }
+
+  // Post-process
+
+  if (!partial_path.empty()) {
+    partial_result partial;
+    if (!make_partial(fb, partial_key, settings.sample_offset, partial) ||
+        !save_partial(partial_path, partial))
+      return 1;
   }
 
-  std::reverse(buf.begin(), buf.end());
-  for (auto rgb : buf) {
-    rgb.print(std::cout);
+  if (output_aovs && !write_aovs(output.empty() ? "aov" : output, fb,
+                                 output_aovs))
+    return 1;
+
+  if (denoise_output) {
+    auto features =
+        feature_samples > 0
+            ? render_features(scene, cam, *sampler, settings, feature_samples)
+            : features_from_aovs(fb.aov);
+    fb = denoise(fb, features);
   }
-  std::cerr << "\nDone.\n";
+
+  if (output.empty() ? !write_to_stdout(*encoder, fb)
+                     : !write_image(output, fb, *encoder))
+    return 1;
+  if (!spp_map.empty() && !write_sample_counts(spp_map, fb))
+    return 1;
+  std::cerr << "\nDone, " << fb.total_samples() << " samples.\n";
 }
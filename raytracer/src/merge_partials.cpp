@@ -0,0 +1,76 @@
+// Merges partial results written by main --partial over disjoint sample
+// ranges of the same render into one image and, optionally, one partial
+// result that can be topped up with more samples later.
+
+#include "rtweekend.hpp"
+
+#include "output.hpp"
+#include "partial.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace raytracer;
+
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options] PARTIAL... > image.ppm\n"
+            << "  --output FILE    write the image to FILE instead of stdout, "
+               "as PPM, PNG,\n"
+            << "                   JPEG, raw, PFM, HDR or EXR by its "
+               "extension\n"
+            << "  --partial FILE   also write the merged partial result\n"
+            << "  --no-variance    leave the variance out of it\n";
+}
+
+int main(int argc, char **argv) {
+  std::string output;
+  std::string partial_path;
+  bool variance = true;
+  std::vector<std::string> inputs;
+
+  for (int a = 1; a < argc; ++a) {
+    auto has_value = a + 1 < argc;
+    if (!std::strcmp(argv[a], "--output") && has_value) {
+      output = argv[++a];
+    } else if (!std::strcmp(argv[a], "--partial") && has_value) {
+      partial_path = argv[++a];
+    } else if (!std::strcmp(argv[a], "--no-variance")) {
+      variance = false;
+    } else if (argv[a][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      inputs.push_back(argv[a]);
+    }
+  }
+  if (inputs.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  partial_result merged;
+  if (!load_partial(inputs[0], merged))
+    return 1;
+  for (size_t k = 1; k < inputs.size(); ++k) {
+    partial_result next;
+    if (!load_partial(inputs[k], next) || !merge_partial(merged, next)) {
+      std::cerr << "ERROR: Could not merge '" << inputs[k] << "'.\n";
+      return 1;
+    }
+  }
+  merged.variance = merged.variance && variance;
+
+  if (!partial_path.empty() && !save_partial(partial_path, merged))
+    return 1;
+  if (output.empty() ? !write_to_stdout(ppm_writer(), merged.fb)
+                     : !write_image(output, merged.fb))
+    return 1;
+
+  std::cerr << "Merged " << inputs.size() << " partial results, "
+            << merged.samples() << " samples per pixel:";
+  for (const auto &r : merged.ranges)
+    std::cerr << " [" << r.first << ", " << r.end << ")";
+  std::cerr << "\n";
+}
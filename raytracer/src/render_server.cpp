@@ -0,0 +1,106 @@
+#include "rtweekend.hpp"
+
+#include "material.hpp"
+#include "render_server.hpp"
+#include "renderer.hpp"
+
+#include <omp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace raytracer;
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void on_signal(int) { interrupted = 1; }
+
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options]\n"
+            << "  --listen ADDR    socket to serve on, host:port or "
+               "unix:/path\n"
+            << "                   (default unix:/tmp/raytracer.sock)\n"
+            << "  --cache-mb N     memory for loaded scenes (default 1024)\n"
+            << "  --threads N      render threads (default: all)\n"
+            << "  --numa MODE      off (default), pin or replicate\n"
+            << "  --timeout S      drop clients that send or read nothing "
+               "for S seconds\n"
+            << "                   (default 10)\n"
+            << "  --quiet          do not log jobs\n";
+}
+
+int main(int argc, char **argv) {
+  std::string listen_address = "unix:/tmp/raytracer.sock";
+  size_t cache_mb = 1024;
+  int threads = omp_get_max_threads();
+  numa_mode numa = numa_mode::off;
+  double timeout = 10;
+  bool log = true;
+
+  for (int a = 1; a < argc; ++a) {
+    auto has_value = a + 1 < argc;
+    if (!std::strcmp(argv[a], "--listen") && has_value) {
+      listen_address = argv[++a];
+    } else if (!std::strcmp(argv[a], "--cache-mb") && has_value) {
+      cache_mb = std::stoul(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--threads") && has_value) {
+      threads = std::stoi(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--numa") && has_value) {
+      std::string mode = argv[++a];
+      if (mode == "off")
+        numa = numa_mode::off;
+      else if (mode == "pin")
+        numa = numa_mode::pin;
+      else if (mode == "replicate")
+        numa = numa_mode::replicate;
+      else {
+        std::cerr << "Unknown NUMA mode '" << mode << "'.\n";
+        return 1;
+      }
+    } else if (!std::strcmp(argv[a], "--timeout") && has_value) {
+      timeout = std::stod(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--quiet")) {
+      log = false;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  socket_address address;
+  if (!socket_address::parse(listen_address, address)) {
+    std::cerr << "Bad address '" << listen_address << "'.\n";
+    return 1;
+  }
+  auto listener = listen_on(address);
+  if (!listener)
+    return 1;
+  std::signal(SIGINT, on_signal);
+  std::signal(SIGTERM, on_signal);
+
+  // The pool and the scenes outlive the jobs; that is the point.
+  Renderer renderer(threads, numa);
+  scene_cache cache(cache_mb << 20);
+  std::cerr << "Serving on " << listen_address << " with "
+            << renderer.threads() << " threads.\n";
+
+  // Jobs run one at a time, each on all threads, so a client that stalls
+  // is dropped after the timeout rather than holding up the others.
+  while (!interrupted) {
+    pollfd p{listener.get(), POLLIN, 0};
+    if (poll(&p, 1, 200) <= 0)
+      continue;
+    socket_fd client(accept(listener.get(), nullptr, nullptr));
+    if (client && set_timeouts(client.get(), timeout))
+      serve_render_job(client.get(), cache, renderer, log);
+  }
+
+  if (address.unix_domain)
+    unlink(address.path.c_str());
+  std::cerr << "Stopped.\n";
+}
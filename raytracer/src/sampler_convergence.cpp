@@ -0,0 +1,100 @@
+// Samples per pixel each sampler needs to reach a target error on
+// random_scene(), measured as RMSE against a high sample count reference.
+
+#include "rtweekend.hpp"
+
+#include "camera.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scenes.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace raytracer;
+
+int main(int argc, char **argv) {
+  const int image_width = argc > 1 ? std::stoi(argv[1]) : 96;
+  const int reference_spp = argc > 2 ? std::stoi(argv[2]) : 4096;
+  const int max_spp = 256;
+
+  render_settings settings;
+  settings.image_width = image_width;
+  settings.image_height = static_cast<int>(image_width / (16.0 / 9.0));
+  settings.progress = false;
+  const int n = settings.image_width * settings.image_height;
+
+  auto scene = random_scene();
+  scene.build(0.0, 1.0);
+  Point lookfrom(13, 2, 3);
+  Point lookat(0, 0, 0);
+  Camera cam(lookfrom, lookat, Vector(0, 1, 0), 20, 16.0 / 9.0, 0.1,
+             (lookfrom - lookat).length(), 0.0, 1.0);
+
+  std::fprintf(stderr, "Reference: %dx%d at %d spp\n", settings.image_width,
+               settings.image_height, reference_spp);
+  settings.samples_per_pixel = reference_spp;
+  auto fb = render(scene, cam, SobolSampler(~rng_seed()), settings);
+  std::vector<Color> reference(n);
+  for (int p = 0; p < n; ++p)
+    reference[p] = fb.mean(p);
+
+  const std::vector<std::string> names = {"independent", "halton", "sobol",
+                                          "bluenoise"};
+  // rmse[s][k] is the error of sampler s at 2^k samples per pixel.
+  std::vector<std::vector<double>> rmse(names.size());
+
+  for (size_t s = 0; s < names.size(); ++s) {
+    auto sampler = make_sampler(names[s]);
+    std::vector<Color> sums(n);
+    for (int done = 0, spp = 1; spp <= max_spp; done = spp, spp *= 2) {
+#pragma omp parallel for
+      for (int j = 0; j < settings.image_height; ++j)
+        for (int i = 0; i < settings.image_width; ++i)
+          for (int t = done; t < spp; ++t)
+            sums[j * settings.image_width + i] +=
+                render_sample(scene, cam, *sampler, settings, i, j, t);
+      double err = 0;
+      for (int p = 0; p < n; ++p) {
+        auto d = sums[p] / spp - reference[p];
+        err += d.length_squared() / 3;
+      }
+      rmse[s].push_back(std::sqrt(err / n));
+    }
+  }
+
+  std::printf("%-8s", "spp");
+  for (const auto &name : names)
+    std::printf(" %12s", name.c_str());
+  std::printf("\n");
+  for (size_t k = 0; k < rmse[0].size(); ++k) {
+    std::printf("%-8d", 1 << k);
+    for (size_t s = 0; s < names.size(); ++s)
+      std::printf(" %12.5f", rmse[s][k]);
+    std::printf("\n");
+  }
+
+  // Target: the error of the independent sampler at 64 spp. Samples needed
+  // are interpolated on the log-log error curve.
+  const double target = rmse[0][6];
+  std::printf("\nspp to reach RMSE %.5f:\n", target);
+  for (size_t s = 0; s < names.size(); ++s) {
+    double needed = -1;
+    for (size_t k = 0; k < rmse[s].size(); ++k) {
+      if (rmse[s][k] > target)
+        continue;
+      needed = 1;
+      if (k > 0) {
+        auto e0 = std::log(rmse[s][k - 1]), e1 = std::log(rmse[s][k]);
+        needed = std::exp2(k - 1 + (e0 - std::log(target)) / (e0 - e1));
+      }
+      break;
+    }
+    if (needed < 0)
+      std::printf("  %-12s > %d\n", names[s].c_str(), max_spp);
+    else
+      std::printf("  %-12s %.0f\n", names[s].c_str(), needed);
+  }
+}
@@ -0,0 +1,60 @@
+// Tonemaps a linear image written by main --format pfm or hdr into an 8 bit
+// image, so that exposure and curve can be changed without rendering again.
+
+#include "rtweekend.hpp"
+
+#include "output.hpp"
+#include "tonemap.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace raytracer;
+
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options] IMAGE.pfm|IMAGE.hdr "
+            << "> image.ppm\n"
+            << "  --output FILE    write the image to FILE instead of stdout, "
+               "as PPM, PNG,\n"
+            << "                   JPEG or raw by its extension\n"
+            << "  --exposure EV    scale the radiance by 2^EV (default 0)\n"
+            << "  --tonemap CURVE  clamp (default), reinhard or aces\n";
+}
+
+int main(int argc, char **argv) {
+  std::string output;
+  std::string input;
+  tonemap_settings tonemap;
+
+  for (int a = 1; a < argc; ++a) {
+    auto has_value = a + 1 < argc;
+    if (!std::strcmp(argv[a], "--output") && has_value) {
+      output = argv[++a];
+    } else if (!std::strcmp(argv[a], "--exposure") && has_value) {
+      tonemap.exposure = std::stod(argv[++a]);
+    } else if (!std::strcmp(argv[a], "--tonemap") && has_value) {
+      if (!parse_tonemap_curve(argv[++a], tonemap.curve)) {
+        std::cerr << "Unknown tonemap curve '" << argv[a] << "'.\n";
+        return 1;
+      }
+    } else if (argv[a][0] == '-' || !input.empty()) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      input = argv[a];
+    }
+  }
+  if (input.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  framebuffer fb;
+  if (!read_linear_image(input, fb))
+    return 1;
+  auto writer = image_writer_for(output, tonemap);
+  if (output.empty() ? !write_to_stdout(*writer, fb)
+                     : !write_image(output, fb, *writer))
+    return 1;
+}
@@ -0,0 +1,62 @@
+// Starts a background render on a Renderer with per node scene replicas and
+// at once renders another scene on it. The background render must still
+// render its own scene: its image has to match a plain render of that scene.
+// Two NUMA nodes are simulated over the CPUs the test may run on.
+
+#include "renderer.hpp"
+#include "scenes.hpp"
+
+#include <iostream>
+
+using namespace raytracer;
+
+static frozen_scene built(Scene scene) {
+  scene.build(0.0, 1.0);
+  return freeze(std::move(scene));
+}
+
+static bool same(const framebuffer &a, const framebuffer &b) {
+  if (a.count != b.count)
+    return false;
+  for (size_t p = 0; p < a.sum.size(); ++p)
+    for (int c = 0; c < 3; ++c)
+      if (a.sum[p][c] != b.sum[p][c])
+        return false;
+  return true;
+}
+
+int main() {
+  auto first = built(two_spheres());
+  auto second = built(simple_light());
+  auto cam = camera_params().camera();
+  std::shared_ptr<const Sampler> sampler = make_sampler("independent", 7);
+
+  render_settings settings;
+  settings.image_width = 64;
+  settings.image_height = 36;
+  settings.samples_per_pixel = 2;
+  settings.progress = false;
+  auto expected = render(*first, cam, *sampler, settings);
+
+  numa_topology topology;
+  topology.nodes = {thread_cpus(), thread_cpus()};
+  Renderer renderer(4, numa_mode::replicate, topology);
+  if (!renderer.replicates()) {
+    std::cerr << "Renderer does not make scene replicas.\n";
+    return 1;
+  }
+
+  for (int run = 0; run < 10; ++run) {
+    auto handle = renderer.render_async(first, cam, sampler, settings);
+    renderer.render(*second, cam, *sampler, settings);
+    if (!handle->wait()) {
+      std::cerr << "Background render did not complete.\n";
+      return 1;
+    }
+    if (!same(handle->image(), expected)) {
+      std::cerr << "Background render " << run
+                << " differs from a plain render of its scene.\n";
+      return 1;
+    }
+  }
+}
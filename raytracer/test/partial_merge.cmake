@@ -0,0 +1,37 @@
+# Renders SPP samples of the simple_light scene in one run and as two
+# partials of SPP / 2 samples, merges the partials and fails unless the
+# merged images, linear and 8 bit, are identical to those of the one run.
+# Usage: cmake -DMAIN=path/to/main -DMERGE=path/to/merge_partials -DSPP=N
+#        -DWORK_DIR=dir -P this
+
+math(EXPR half "${SPP} / 2")
+set(scene --scene simple_light --seed 7)
+
+function(run what)
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE result ERROR_VARIABLE log)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${what} failed:\n${log}")
+  endif()
+endfunction()
+
+foreach(ext IN ITEMS pfm ppm)
+  run("Single run" ${MAIN} ${scene} --spp ${SPP}
+      --output ${WORK_DIR}/single.${ext})
+endforeach()
+run("First partial" ${MAIN} ${scene} --spp ${half}
+    --partial ${WORK_DIR}/first.part --output ${WORK_DIR}/first.ppm)
+run("Second partial" ${MAIN} ${scene} --spp ${half} --sample-offset ${half}
+    --partial ${WORK_DIR}/second.part --output ${WORK_DIR}/second.ppm)
+
+foreach(ext IN ITEMS pfm ppm)
+  run("Merge" ${MERGE} ${WORK_DIR}/first.part ${WORK_DIR}/second.part
+      --output ${WORK_DIR}/merged.${ext})
+  execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files
+            ${WORK_DIR}/single.${ext} ${WORK_DIR}/merged.${ext}
+    RESULT_VARIABLE different
+  )
+  if(different)
+    message(FATAL_ERROR "Merged partials differ from a single run (${ext}).")
+  endif()
+endforeach()
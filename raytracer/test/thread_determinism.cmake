@@ -0,0 +1,31 @@
+# Renders the random scene with one thread and with THREADS threads, the
+# latter in another tile order, and fails unless the images are identical.
+# Usage: cmake -DMAIN=path/to/main -DTHREADS=N -DWORK_DIR=dir -P this
+
+foreach(run IN ITEMS 1 ${THREADS})
+  if(run EQUAL 1)
+    set(order hilbert)
+  else()
+    set(order morton)
+  endif()
+  set(image ${WORK_DIR}/determinism.${run}.ppm)
+  execute_process(
+    COMMAND ${CMAKE_COMMAND} -E env OMP_NUM_THREADS=${run}
+            ${MAIN} --scene random --spp 2 --seed 7 --tile-order ${order}
+            --output ${image}
+    RESULT_VARIABLE result
+    ERROR_VARIABLE log
+  )
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Render with ${run} threads failed:\n${log}")
+  endif()
+endforeach()
+
+execute_process(
+  COMMAND ${CMAKE_COMMAND} -E compare_files
+          ${WORK_DIR}/determinism.1.ppm ${WORK_DIR}/determinism.${THREADS}.ppm
+  RESULT_VARIABLE different
+)
+if(different)
+  message(FATAL_ERROR "Renders with 1 and ${THREADS} threads differ.")
+endif()